@@ -15,6 +15,9 @@ g++ IIL.cpp\
     "sandbox-dir": "/tmp/recos_sandbox/bkdkl"
     }
 
+    optional "relabel-ids": true orders coded ids by user activity
+    and item popularity instead of first seen order
+
 
   date && time /tmp/iil /tmp/getsim.json  && date
 
@@ -56,7 +59,11 @@ void startIndex(Json::Value root)
     if(root.isMember("max-threads-count")){
       threadsCount = root["max-threads-count"].asInt();
     }
-    rd.createRatingsStore(csvpath, sandboxDir, threadsCount);
+    bool relabelIds = false;
+    if(root.isMember("relabel-ids")){
+      relabelIds = root["relabel-ids"].asBool();
+    }
+    rd.createRatingsStore(csvpath, sandboxDir, threadsCount, relabelIds);
     return;
   }
 }
@@ -16,9 +16,10 @@ class RecoDriver {
   {
   }
 
-  void createRatingsStore(string csvpath, string outfilesDir, INT_T threadsCount)
+  void createRatingsStore(string csvpath, string outfilesDir, INT_T threadsCount,
+    bool relabelIds = false)
   {
-    RatingsStore rs(csvpath, outfilesDir, threadsCount);
+    RatingsStore rs(csvpath, outfilesDir, threadsCount, relabelIds);
   }
 
   void loadRecoSetup(string recosetupdir)
@@ -8,9 +8,13 @@
        -lboost_program_options \
        -lpthread \
        -O3 \
+       -march=native \
        -o /tmp/itemitem-learner \
        -std=c++11
 
+  -march=native (or -mavx2) enables the AVX2 kernel used by
+  --similarity-precision int8, without it a scalar loop is used
+
   Usage:
   export DYLD_LIBRARY_PATH=/opt/boost/1_61_0/lib:$DYLD_LIBRARY_PATH
   export LD_LIBRARY_PATH=/opt/boost/1_61_0/lib:$LD_LIBRARY_PATH
@@ -61,6 +65,25 @@ Linux:
       && \
   date
 
+  User-user neighbours:
+  use --recommendation-type user-user with --top-K-neighbours 50
+  --user-neighbours-file-path /tmp/user-neighbours.csr. Items with more
+  than --max-item-raters (default 20000) raters are not used to find
+  candidates, which bounds the search on large data sets (the similarity
+  of a candidate still uses every item both users rated);
+  --max-item-raters 0 walks every item's raters
+
+  Incremental updates:
+  add --pair-stats-file-path /tmp/pair-stats.bin to the run above, later
+  apply new ratings (same csv format) without recomputing all pairs
+
+  /tmp/itemitem-learner  \
+         --incremental-ratings-csv-path /tmp/new-ratings.csv \
+         --pair-stats-file-path /tmp/pair-stats.bin \
+         --sim-mtx-file-save-path /tmp/sim-vals.mtx \
+         --item-index-table-path /tmp/itm.idx \
+         --user-index-table-path /tmp/usr.idx
+
 */
 
 #include <iostream>
@@ -94,6 +117,20 @@ const char * sim_mtx_file_save_path_str = "Path of similarity matrix to save " ;
 const char * item_index_table_path_str = "Item's index lookup table path to save ";
 const char * user_index_table_path_str = "User's index lookup table path to save ";
 const char * wait_for_debugger_str = "Wait for debugger to connect in a while(1) loop ";
+const char * user_neighbours_file_path_str = "Path of user neighbour lists to save "
+        "for 'user-user' recommendation type ";
+const char * max_item_raters_str = "Items rated by more users than this are not used "
+        "to find candidate neighbours for 'user-user' (default 20000), 0 for no limit, "
+        "similarities are computed over all co-rated items either way ";
+const char * relabel_ids_str = "1 to order coded ids by user activity and item "
+        "popularity instead of raw id order ";
+const char * similarity_precision_str = "'float' or 'int8', int8 stores mean centered "
+        "ratings in one byte and uses integer SIMD dot products, the error "
+        "against float is reported on sampled pairs ";
+const char * pair_stats_file_path_str = "Path of item pair statistics to save, "
+        "needed for incremental updates ";
+const char * incremental_ratings_csv_path_str = "Path of csv file with new ratings "
+        "to apply to a previous run's similarity matrix and pair statistics ";
 
 volatile bool use_debugger = false;
 
@@ -118,6 +155,12 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
                 ("item-index-table-path", ProgOpts::value<STRING_T>(), item_index_table_path_str)
                 ("user-index-table-path", ProgOpts::value<STRING_T>(), user_index_table_path_str)
                 ("wait-for-debugger", ProgOpts::value<INT_T>(), wait_for_debugger_str)
+                ("user-neighbours-file-path", ProgOpts::value<STRING_T>(), user_neighbours_file_path_str)
+                ("max-item-raters", ProgOpts::value<INT_T>(), max_item_raters_str)
+                ("relabel-ids", ProgOpts::value<INT_T>(), relabel_ids_str)
+                ("similarity-precision", ProgOpts::value<STRING_T>(), similarity_precision_str)
+                ("pair-stats-file-path", ProgOpts::value<STRING_T>(), pair_stats_file_path_str)
+                ("incremental-ratings-csv-path", ProgOpts::value<STRING_T>(), incremental_ratings_csv_path_str)
                 ; // leave this semi colon at end don't move this
 
         ProgOpts::store(ProgOpts::parse_command_line(argc, argv, desc), varMap);
@@ -176,6 +219,24 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
 
         params.user_index_table_path = varMap.count("user-index-table-path") ?
                   varMap["user-index-table-path"].as<STRING_T>() : STRING_T("/tmp/user-index-table.idx");
+
+        params.user_neighbours_file_path = varMap.count("user-neighbours-file-path") ?
+                  varMap["user-neighbours-file-path"].as<STRING_T>() : STRING_T("/tmp/user-neighbours.csr");
+
+        params.max_item_raters = varMap.count("max-item-raters") ?
+                  varMap["max-item-raters"].as<INT_T>() : 20000;
+
+        params.relabel_ids = varMap.count("relabel-ids") ?
+                  varMap["relabel-ids"].as<INT_T>() : 0;
+
+        params.similarity_precision = varMap.count("similarity-precision") ?
+                  varMap["similarity-precision"].as<STRING_T>() : STRING_T("float");
+
+        params.pair_stats_file_path = varMap.count("pair-stats-file-path") ?
+                  varMap["pair-stats-file-path"].as<STRING_T>() : STRING_T("");
+
+        params.incremental_ratings_csv_path = varMap.count("incremental-ratings-csv-path") ?
+                  varMap["incremental-ratings-csv-path"].as<STRING_T>() : STRING_T("");
     }
     catch(exception &e)
     {
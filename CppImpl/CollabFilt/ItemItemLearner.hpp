@@ -9,8 +9,12 @@
 #include <thread>
 #include <boost/dynamic_bitset.hpp>
 
-#include "../utils/Mtx.hpp"
+#include "../utils/TriMtx.hpp"
 #include "../utils/UserItemTableHelper.hpp"
+#include "../utils/IdRelabeler.hpp"
+#include "SimilarityStats.hpp"
+#include "QuantizedRatings.hpp"
+#include "UserUserLearner.hpp"
 
 typedef boost::dynamic_bitset<> DynBitSet;
 typedef map<INT_T, FLT_T> * UID_RATING_PTR;
@@ -36,6 +40,12 @@ struct NeighbourHoodRecoParams {
     STRING_T sim_mtx_file_save_path;
     STRING_T item_index_table_path;
     STRING_T user_index_table_path;
+    STRING_T pair_stats_file_path;
+    STRING_T incremental_ratings_csv_path;
+    STRING_T user_neighbours_file_path;
+    INT_T max_item_raters;
+    INT_T relabel_ids;
+    STRING_T similarity_precision; // "float" or "int8"
 };
 
 struct ItemCombination {
@@ -97,7 +107,9 @@ class NeighbourHoodRecommender {
     INT_T train_start, train_end, test_start, test_end;
     vector <long long> randomShuffledIndexes;
 
-    Mtx * simTbl; // similarity table
+    TriMtx * simTbl; // similarity table, upper triangle only
+    PairStatsStore * pairStats; // only when pair_stats_file_path is set
+    QuantizedItemRatings * q8Ratings; // only when similarity_precision is int8
 
     inline void partitionAsTrainingAndValidationSets(vector<RatingEntry> &T) {
         FLT_T tpct = T.size() * algoParams.training_sample_percentage;
@@ -145,16 +157,14 @@ class NeighbourHoodRecommender {
     void checkItemSimiliarty()
     {
       cout << " checkItemSimiliarty()\n";
-      auto flt_min = std::numeric_limits<FLT_T>::min();
       INT_T num_items = item_index_table.size();
-      simTbl = new Mtx(num_items, num_items, flt_min);
+      simTbl = new TriMtx(num_items);
       INT_T item1 = 0, item2 = 0;
       INT_T cmb = 0;
       while(item1 < num_items) {
         for(item2 = item1+1; item2 < num_items; item2++) {
-          FLT_T sim = getSimilarity(item1, item2);
+          FLT_T sim = computeSimilarity(item1, item2);
           simTbl->set(item1, item2, sim);
-          simTbl->set(item2, item1, sim);
           cmb++;
         }
         item1++;
@@ -168,9 +178,8 @@ class NeighbourHoodRecommender {
       cout << " checkItemSimiliartyThreaded() threadCount " << threadCount << "\n";
       simCalcThreadCount = threadCount;
 
-      auto flt_min = std::numeric_limits<FLT_T>::min();
       INT_T num_items = item_index_table.size();
-      simTbl = new Mtx(num_items, num_items, flt_min);
+      simTbl = new TriMtx(num_items);
       INT_T item1 = 0, item2 = 0;
 
       while(item1 < num_items) {
@@ -212,6 +221,282 @@ class NeighbourHoodRecommender {
       simTbl->writeMtxToFileSystem(algoParams.sim_mtx_file_save_path.c_str());
     }
 
+    bool isInt8Precision()
+    {
+      return algoParams.similarity_precision == "int8";
+    }
+
+    // Replaces the float quick rating rows by int8 rows, after reporting
+    // how far int8 similarities are from float ones on sampled pairs
+    void quantizeRatings()
+    {
+    START_TIME_STAMP("quantizeRatings");
+      q8Ratings = new QuantizedItemRatings();
+      long long floatBytes = 0;
+      for(INT_T i=0; i<itemRV.size(); i++) {
+        q8Ratings->addItem(itemRtQuick[i], itemRV[i]);
+        floatBytes += itemRtQuick[i].size() * sizeof(FLT_T);
+      }
+      cout << " quick rating rows float " << floatBytes << " bytes, int8 "
+        << q8Ratings->memoryBytes() << " bytes\n";
+
+      reportQuantizationError(100000);
+      vector<fltvec>().swap(itemRtQuick);
+    END_TIME_STAMP;
+    }
+
+    void reportQuantizationError(INT_T numSamples)
+    {
+      INT_T num_items = itemRV.size();
+      if(num_items < 2)
+        return;
+
+      std::srand(std::time(0));
+      double maxErr = 0, sumErr = 0;
+      INT_T compared = 0, nanMismatch = 0;
+      INT_T maxI1 = -1, maxI2 = -1;
+      long long allPairs = (long long) num_items * (num_items - 1) / 2;
+      bool sampled = allPairs > numSamples;
+      INT_T i1 = 0, i2 = 1;
+
+      for(long long x = 0; x < min(allPairs, (long long) numSamples); x++) {
+        if(sampled) {
+          i1 = newRandom(num_items);
+          i2 = newRandom(num_items - 1);
+          i2 += (i2 >= i1);
+        }
+        FLT_T f = getSimilarity(i1, i2);
+        FLT_T q = getSimilarityQ8(i1, i2);
+        if(isnan(f) || isnan(q)) {
+          nanMismatch += isnan(f) != isnan(q);
+        } else {
+          double err = fabs(f - q);
+          sumErr += err;
+          compared++;
+          if(err > maxErr) {
+            maxErr = err;
+            maxI1 = i1;
+            maxI2 = i2;
+          }
+        }
+        if(!sampled && ++i2 == num_items) {
+          i1++;
+          i2 = i1 + 1;
+        }
+      }
+
+      cout << " int8 vs float similarity over " << compared
+        << (sampled ? " sampled" : "") << " pairs: max abs error " << maxErr
+        << " (items " << maxI1 << ", " << maxI2 << ") mean abs error "
+        << (compared ? sumErr / compared : 0)
+        << " nan mismatches " << nanMismatch << "\n";
+    }
+
+    bool isPairStatsEnabled()
+    {
+      return !algoParams.pair_stats_file_path.empty();
+    }
+
+    bool isIncrementalUpdate()
+    {
+      return !algoParams.incremental_ratings_csv_path.empty();
+    }
+
+    void buildPairStats()
+    {
+      pairStats = new PairStatsStore(item_index_table.size(),
+        user_index_table.size());
+      for(INT_T i=0; i<itemRV.size(); i++) {
+        RatingVector &rv = itemRV[i];
+        for(INT_T x=0; x<rv.size(); x++) {
+          pairStats->setRating(rv[x].uId, i, rv[x].rtng);
+        }
+      }
+      pairStats->build(algoParams.max_thread_count);
+      cout << " pair stats retained for " << pairStats->getNumPairs()
+        << " item pairs\n";
+    }
+
+    void updateSimilarityFromStats(INT_T i1, INT_T i2)
+    {
+      const PairStats *ps = pairStats->getPairStats(i1, i2);
+      FLT_T sim = ps ? getSimilarityFromStats(*ps,
+        pairStats->getItemMean(min(i1, i2)),
+        pairStats->getItemMean(max(i1, i2))) : 0;
+      simTbl->set(i1, i2, sim);
+    }
+
+    void similarityFromStatsThread(std::atomic<INT_T> &nextRow)
+    {
+      INT_T num_items = pairStats->getNumItems();
+      for(INT_T i1 = nextRow++; i1 < num_items; i1 = nextRow++) {
+        double m1 = pairStats->getItemMean(i1);
+        PAIR_STATS_ROW &row = pairStats->getRow(i1);
+        for(auto it = row.begin(); it != row.end(); ++it) {
+          FLT_T sim = getSimilarityFromStats(it->second, m1,
+            pairStats->getItemMean(it->first));
+          simTbl->set(i1, it->first, sim);
+        }
+      }
+    }
+
+    // Recomputes the similarities of the pairs with a dirty item, only the
+    // pairs in the stats can be nonzero: counts never go down, so a pair
+    // without co-raters is still 0 in the table. A pair of two dirty items
+    // is left to its smaller item, so every cell has one writer.
+    void incrementalSimilarityThread(vector<INT_T> &dirtyList,
+      vector<char> &dirtyItems, std::atomic<INT_T> &nextDirty)
+    {
+      vector<char> seen(pairStats->getNumItems(), 0);
+      vector<INT_T> below;
+      for(INT_T d = nextDirty++; d < dirtyList.size(); d = nextDirty++) {
+        INT_T i1 = dirtyList[d];
+        double m1 = pairStats->getItemMean(i1);
+        PAIR_STATS_ROW &row = pairStats->getRow(i1);
+        for(auto it = row.begin(); it != row.end(); ++it) {
+          simTbl->set(i1, it->first, getSimilarityFromStats(it->second, m1,
+            pairStats->getItemMean(it->first)));
+        }
+        pairStats->getPartnersBelow(i1, seen, below);
+        for(INT_T x = 0; x < below.size(); x++) {
+          if(!dirtyItems[below[x]])
+            updateSimilarityFromStats(below[x], i1);
+        }
+      }
+    }
+
+    // same table as checkItemSimiliarty(), computed from the pair stats
+    void checkItemSimiliartyFromStats()
+    {
+    START_TIME_STAMP("checkItemSimiliartyFromStats");
+      buildPairStats();
+
+      INT_T num_items = item_index_table.size();
+      simTbl = new TriMtx(num_items);
+
+      std::atomic<INT_T> nextRow(0);
+      vector<thread> threadList;
+      for(INT_T i=0; i<algoParams.max_thread_count; i++) {
+        threadList.push_back(thread(
+          &NeighbourHoodRecommender::similarityFromStatsThread, this,
+          std::ref(nextRow)));
+      }
+      for(INT_T i=0; i<threadList.size(); i++) {
+        threadList[i].join();
+      }
+
+      simTbl->writeMtxToFileSystem(algoParams.sim_mtx_file_save_path.c_str());
+      pairStats->writeToFileSystem(algoParams.pair_stats_file_path.c_str());
+    END_TIME_STAMP;
+    }
+
+    INT_T getOrAddCodedUser(map<INT_T, INT_T> &usrCodes, INT_T userid)
+    {
+      auto it = usrCodes.find(userid);
+      if(it != usrCodes.end())
+        return it->second;
+      INT_T cuid = user_index_table.size();
+      user_index_table.push_back(userid);
+      usrCodes[userid] = cuid;
+      return cuid;
+    }
+
+    // Applies the ratings in incremental_ratings_csv_path to a previous
+    // run's pair stats and similarity table. Only similarities of items
+    // that received ratings are recomputed, over their co-rated partners
+    // and spread over max_thread_count threads; their means are taken from
+    // the updated stats so mean drift is handled exactly. Ratings of items
+    // unknown to the previous run are skipped, those need a full rebuild.
+    bool applyIncrementalRatings()
+    {
+    START_TIME_STAMP("applyIncrementalRatings");
+      cout << " NeighbourHoodRecommender::applyIncrementalRatings from "
+        << algoParams.incremental_ratings_csv_path << "\n";
+      if(!isPairStatsEnabled())
+        throw("NeighbourHoodRecommender::applyIncrementalRatings "
+          "needs pair_stats_file_path");
+
+      readIndexTableFromFileSystem(item_index_table,
+        algoParams.item_index_table_path.c_str());
+      readIndexTableFromFileSystem(user_index_table,
+        algoParams.user_index_table_path.c_str());
+      pairStats = new PairStatsStore(algoParams.pair_stats_file_path.c_str());
+      simTbl = new TriMtx(algoParams.sim_mtx_file_save_path.c_str());
+
+      if(pairStats->getNumItems() != item_index_table.size() ||
+        simTbl->rows != item_index_table.size())
+        throw("NeighbourHoodRecommender::applyIncrementalRatings "
+          "pair stats, similarity table and item index do not match");
+
+      map<INT_T, INT_T> usrCodes, itmCodes;
+      for(INT_T i=0; i<user_index_table.size(); i++)
+        usrCodes[user_index_table[i]] = i;
+      for(INT_T i=0; i<item_index_table.size(); i++)
+        itmCodes[item_index_table[i]] = i;
+
+      FILE * csvFile = fopen(algoParams.incremental_ratings_csv_path.c_str(), "r");
+      if(!csvFile) {
+        cout << "ERROR: Unable to open input file check "
+          << algoParams.incremental_ratings_csv_path
+          << " check --incremental-ratings-csv-path arg"<< "\n";
+        return false;
+      }
+
+      INT_T userid, itemid, rating;
+      INT_T applied = 0, skipped = 0;
+      vector<char> dirtyItems(item_index_table.size(), 0);
+
+      while(true) {
+        int r = fscanf(csvFile,"%d %d %d",&userid, &itemid, &rating);
+        if(r<0) {
+          break;
+        }
+        auto itmIt = itmCodes.find(itemid);
+        if(itmIt == itmCodes.end()) {
+          skipped++;
+          continue;
+        }
+        INT_T cuid = getOrAddCodedUser(usrCodes, userid);
+        pairStats->addRating(cuid, itmIt->second, rating);
+        dirtyItems[itmIt->second] = 1;
+        applied++;
+      }
+      fclose(csvFile);
+
+      INT_T num_items = item_index_table.size();
+      vector<INT_T> dirtyList;
+      for(INT_T i1=0; i1<num_items; i1++) {
+        if(dirtyItems[i1])
+          dirtyList.push_back(i1);
+      }
+      INT_T dirtyCount = dirtyList.size();
+      START_TIME_STAMP0(recomputeStr, "incremental similarity recompute", recomputeStart);
+      pairStats->indexItemRaters();
+
+      std::atomic<INT_T> nextDirty(0);
+      vector<thread> threadList;
+      for(INT_T i=0; i<algoParams.max_thread_count; i++) {
+        threadList.push_back(thread(
+          &NeighbourHoodRecommender::incrementalSimilarityThread, this,
+          std::ref(dirtyList), std::ref(dirtyItems), std::ref(nextDirty)));
+      }
+      for(INT_T i=0; i<threadList.size(); i++) {
+        threadList[i].join();
+      }
+      END_TIME_STAMP0(recomputeStr, recomputeEnd, recomputeStart);
+
+      cout << " ratings applied " << applied << " skipped (unknown item) "
+        << skipped << " items updated " << dirtyCount << "/" << num_items << "\n";
+      if(skipped)
+        cout << " run a full rebuild to include the skipped items\n";
+
+      simTbl->writeMtxToFileSystem(algoParams.sim_mtx_file_save_path.c_str());
+      pairStats->writeToFileSystem(algoParams.pair_stats_file_path.c_str());
+      writeItemAndUserIndexTables();
+    END_TIME_STAMP;
+      return true;
+    }
+
     void setItemsRatingMaps(RatingVector &rv,
           DynBitSet &ubst, FLT_T avgRating, vector<FLT_T> &quickRating)
     {
@@ -294,6 +579,26 @@ class NeighbourHoodRecommender {
         }
         cout << " user_index_table.size() " << user_index_table.size()
           << " item_index_table.size() " << item_index_table.size() << "\n";
+
+        if(algoParams.relabel_ids)
+          relabelUserAndItemIndexes();
+    }
+
+    // most active users and most popular items get the smallest coded ids
+    void relabelUserAndItemIndexes() {
+        vector<long long> usrCounts(user_index_table.size(), 0);
+        vector<long long> itmCounts(item_index_table.size(), 0);
+        for(INT_T i = 0; i< ratingsList->size(); i++) {
+          RatingEntry &re = ratingsList->at(i);
+          usrCounts[uidRMap[re.user_id]]++;
+          itmCounts[iidRMap[re.item_id]]++;
+        }
+        relabelByCount(user_index_table, usrCounts);
+        relabelByCount(item_index_table, itmCounts);
+        updateReverseMap(user_index_table, uidRMap);
+        updateReverseMap(item_index_table, iidRMap);
+        cout << " relabeled ids, most active user rated " << usrCounts[0]
+          << " items, most popular item has " << itmCounts[0] << " ratings\n";
     }
 
     void shuffleRatingsListIndexes() {
@@ -453,6 +758,26 @@ class NeighbourHoodRecommender {
       fclose(fp);
     }
 
+    void readIndexTableFromFileSystem(vector<INT_T> &vi, const char * path)
+    {
+      FILE *fp = fopen(path, "rb");
+      if(!fp)
+        throw("NeighbourHoodRecommender::readIndexTableFromFileSystem if(!fp)");
+      long long viSz = 0;
+      size_t sz = fread(&viSz, sizeof(viSz), 1, fp);
+      if(sz!=1 || viSz < 0) {
+        fclose(fp);
+        throw("NeighbourHoodRecommender::readIndexTableFromFileSystem if(sz!=1)");
+      }
+
+      vi = vector<INT_T>(viSz);
+      if(viSz && fread(&vi[0], sizeof(INT_T), viSz, fp) != viSz) {
+        fclose(fp);
+        throw("NeighbourHoodRecommender::readIndexTableFromFileSystem read != viSz");
+      }
+      fclose(fp);
+    }
+
     void writeItemAndUserIndexTables()
     {
       writeIndexTableToFileSystem(item_index_table,
@@ -477,13 +802,17 @@ class NeighbourHoodRecommender {
     void doItemItemRecommendation() {
         cout << " NeighbourHoodRecommender::doItemItemRecommendation starting\n";
         populateRatings();
-        if(algoParams.max_thread_count ==1)
+        if(isInt8Precision() && !isPairStatsEnabled())
+          quantizeRatings();
+        if(isPairStatsEnabled())
+          checkItemSimiliartyFromStats();
+        else if(algoParams.max_thread_count ==1)
           checkItemSimiliarty();
         else
           checkItemSimiliartyThreaded(algoParams.max_thread_count);
         writeItemAndUserIndexTables();
         cleanupIntermediates();
-        Mtx mtx2(algoParams.sim_mtx_file_save_path.c_str());
+        TriMtx mtx2(algoParams.sim_mtx_file_save_path.c_str());
         bool b = simTbl->compare(mtx2);
         if(!b) {
           cout << " NeighbourHoodRecommender::doItemItemRecommendation if(!b)\n";
@@ -493,6 +822,33 @@ class NeighbourHoodRecommender {
         }
     }
 
+    bool isUserUserRecommendation()
+    {
+      return algoParams.recommendation_type == "user-user";
+    }
+
+    void doUserUserRecommendation() {
+        cout << " NeighbourHoodRecommender::doUserUserRecommendation starting\n";
+        vector<CSR_ENTRY_T> entries;
+        entries.reserve(ratingsList->size());
+        for(INT_T i = 0; i< ratingsList->size(); i++) {
+          RatingEntry &re = ratingsList->at(i);
+          entries.push_back(CSR_ENTRY_T(uidRMap[re.user_id],
+            iidRMap[re.item_id], re.rating));
+        }
+        DELETE(ratingsList);
+
+        CSRMtx usrRatings(user_index_table.size(), item_index_table.size(), entries);
+        vector<CSR_ENTRY_T>().swap(entries);
+
+        CSRMtx neighbourMtx;
+        UserNeighbourhoodBuilder unb(usrRatings, algoParams.top_K_neighbours,
+          algoParams.max_item_raters, algoParams.max_thread_count);
+        unb.build(neighbourMtx);
+        neighbourMtx.writeToFileSystem(algoParams.user_neighbours_file_path.c_str());
+        writeItemAndUserIndexTables();
+    }
+
     void writeTestSetEntriesToFile(const char *path = "testSetRatingsList.RatingEntry")
     {
       FLT_T rmse = FLT_T_MAX();
@@ -536,16 +892,24 @@ public:
     vector<ItemCombination> itemCombo; // used by threaded version only
 
     FLT_T getSimilarity(INT_T i1, INT_T i2);
+    FLT_T getSimilarityFromStats(const PairStats &ps, double mean1, double mean2);
+    FLT_T getSimilarityQ8(INT_T i1, INT_T i2);
+
+    FLT_T computeSimilarity(INT_T i1, INT_T i2) {
+      return q8Ratings ? getSimilarityQ8(i1, i2) : getSimilarity(i1, i2);
+    }
 
     NeighbourHoodRecommender(NeighbourHoodRecoParams params) :algoParams(params),
         MAX_USERS(params.max_row_dim), MAX_ITEMS(params.max_col_dim),
-        simTbl(0), simCalcThreadCount(0), nextThreadIndex(0)
+        simCalcThreadCount(0), simTbl(0), pairStats(0), q8Ratings(0), nextThreadIndex(0)
     {
         ratingsList = new vector<RatingEntry> ();
     }
 
     ~NeighbourHoodRecommender() {
       cout << " ~NeighbourHoodRecommender() freeing resources \n";
+      DELETE(pairStats);
+      DELETE(q8Ratings);
     }
 
     bool readInput(bool isCrossValidate) {
@@ -564,11 +928,18 @@ public:
 
     bool analyzeInputs() {
 
+        if(isIncrementalUpdate()) {
+          return applyIncrementalRatings();
+        }
+
         if(!readInput(isCrossValidationEnabled())) {
             return false;
         }
 
-        doItemItemRecommendation();
+        if(isUserUserRecommendation())
+          doUserUserRecommendation();
+        else
+          doItemItemRecommendation();
 
         if(isCrossValidationEnabled()) {
           writeTestSetEntriesToFile();
@@ -577,9 +948,9 @@ public:
         return true;
     }
 
+    // one packed cell holds both (row, col) and (col, row)
     void setSimTableValue(INT_T row, INT_T col, FLT_T val) {
         simTbl->set(row, col, val);
-        simTbl->set(col, row, val);
     }
 
 };
@@ -597,9 +968,8 @@ void similarityThread(SimilarityThreadParams<SIMILARITY_TYPE> stp) {
 
     for(int i=itemComboIndexstart; i<=itemComboIndexend; i++){
         ItemCombination ic = reco.itemCombo[i];
-        FLT_T sim = reco.getSimilarity(ic.item1, ic.item2);
+        FLT_T sim = reco.computeSimilarity(ic.item1, ic.item2);
         reco.setSimTableValue(ic.item1, ic.item2, sim);
-        reco.setSimTableValue(ic.item2, ic.item1, sim);
     }
     execShellCommand("date");
     cout << "\n Thread exit " << nextThreadIndex << " exited \n";
@@ -19,13 +19,70 @@
         --top-K-neighbours 17000 \
         --similarity-cutoff-value 0.20 \
         --loop-mode-count 20 \
-        --max-threads-count 6000 \
+        --max-threads-count 16 \
         --input-csv-file-path /tmp/sf41.csv \
         --sim-mtx-file-path /tmp/sim-vals.mtx \
         --item-index-table-path /tmp/itm.idx \
         --user-index-table-path /tmp/usr.idx && \
   date
 
+  With --item-neighbours-file-path /tmp/itm-neighbours.csr the per item top K
+  lists built from the similarity matrix are saved on the first run, later
+  runs load them instead of the matrix. The file records the K, cutoff and
+  similarity matrix (size and modification time) the lists were built with;
+  lists from another matrix, or with a smaller K or higher cutoff than
+  given now, are rebuilt and saved over, larger ones are cut down.
+
+  Recommendations go to --recos-dir (default /tmp/recos/) as one file per
+  user, --reco-output-format tsv or bin writes one recos.<thread>.tsv or
+  recos.<thread>.bin + .idx per worker thread instead.
+
+  Tuning K and the cutoff, one run with the lists built for the largest K and
+  lowest cutoff gives the test set RMSE / MAE of the whole grid, no
+  recommendations are written:
+  /tmp/itemitem-predictor ... \
+        --test-set-file-path /tmp/testSetRatingsList.RatingEntry \
+        --sweep-top-K 10,20,50,100 \
+        --sweep-cutoffs 0.0,0.1,0.2,0.3
+
+  Users are scored by a pool of --max-threads-count threads (at most one per
+  hardware thread, 0 for one per hardware thread) taking --user-chunk-size
+  users (default 64) at a time, the spread of the chunk times is printed at
+  the end.
+
+  Without a similarity matrix, --lazy-similarity-cache-rows 20000 computes an
+  item's similarity row (the learner's adjusted cosine) from the input
+  ratings the first time it is needed and caches up to 20000 rows, evicted
+  by CLOCK (second chance: a row used since the hand last passed stays). --sim-mtx-file-path and
+  --item-neighbours-file-path are not used then. Predictions equal the ones
+  from the learner's matrix of the same ratings, recommendations score the
+  neighbours of the items the user rated (the same items unless
+  --top-K-neighbours cuts the lists).
+
+  --mtx-load-mode mmap maps the similarity matrix read only and shared
+  instead of reading a private copy, several predictor processes then
+  share the page cache. mmap-populate / mmap-willneed also read it ahead.
+
+  --test-set-file-path testSetRatingsList.RatingEntry (written by the learner
+  with --training-sample-percentage below 1) leaves the held out entries out
+  of the input ratings and prints the RMSE and MAE of their predicted ratings,
+  then precision@N, recall@N, NDCG@N and catalog coverage@N of the users' top
+  N lists for each N of --ranking-cutoffs (default 5,10,20). Held out ratings
+  >= --relevant-rating-threshold (default 4) are the relevant items,
+  --ranking-sample-users 1000 evaluates a random 1000 users only.
+
+  User-user, after running the learner with --recommendation-type user-user:
+  /tmp/itemitem-predictor \
+        --recommendation-type user-user \
+        --user-neighbours-file-path /tmp/user-neighbours.csr \
+        --max-threads-count 16 \
+        --input-csv-file-path /tmp/sf41.csv \
+        --item-index-table-path /tmp/itm.idx \
+        --user-index-table-path /tmp/usr.idx
+
+  --test-set-file-path works the same way here, the held out ratings are
+  left out of the input and the user-user predictions are evaluated.
+
 */
 
 #include <iostream>
@@ -33,6 +90,7 @@
 #include <algorithm>
 #include <boost/program_options.hpp>
 #include "ItemItemPredictor.hpp"
+#include "UserUserPredictor.hpp"
 
 namespace ProgOpts = boost::program_options;
 
@@ -47,7 +105,32 @@ STRPTR(wait_for_debugger_str, "Wait for debugger to connect in a while(1) loop "
 STRPTR(similarity_cutoff_str, "Select items only if greater than this cutoff ");
 STRPTR(training_sample_percentage_str,
   "Percentage of data set to be used for training ");
-STRPTR(num_threads_str, "Number of threads to be used ");
+STRPTR(num_threads_str, "Number of threads to be used, capped at the hardware "
+  "threads, 0 for one per hardware thread ");
+STRPTR(user_chunk_size_str, "Users a recommendation thread takes at a time ");
+STRPTR(recommendation_type_str, "Type of Recommendation 'item-item' or 'user-user' ");
+STRPTR(user_neighbours_file_path_str, "Path of user neighbour lists to load from "
+  "for 'user-user' ");
+STRPTR(recos_dir_str, "Directory (or path prefix) the recommendations are written to ");
+STRPTR(reco_output_format_str, "Recommendation output 'files' (one file per user), "
+  "'tsv' or 'bin' (one file per worker thread, bin with an offset index) ");
+STRPTR(mtx_load_mode_str, "How the similarity matrix is loaded 'read', 'mmap', "
+  "'mmap-populate' or 'mmap-willneed' ");
+STRPTR(item_neighbours_file_path_str, "Path of per item top K neighbour lists, "
+  "loaded when present else built from the similarity matrix and saved there ");
+STRPTR(test_set_file_path_str, "Path of the learner's held out test set, "
+  "RMSE, MAE and ranking metrics are reported over it when given ");
+STRPTR(sweep_top_K_str, "Comma separated K values, with --sweep-cutoffs reports "
+  "the test set error of every K and cutoff instead of recommending ");
+STRPTR(sweep_cutoffs_str, "Comma separated similarity cutoffs of the sweep ");
+STRPTR(ranking_cutoffs_str, "Comma separated N values of the precision / recall / "
+  "NDCG / coverage @N ranking metrics ");
+STRPTR(relevant_rating_threshold_str, "Held out ratings at least this are relevant "
+  "items for the ranking metrics ");
+STRPTR(lazy_similarity_cache_rows_str, "Compute similarity rows from the ratings when "
+  "needed and cache at most this many, 0 to load the similarity matrix ");
+STRPTR(ranking_sample_users_str, "Evaluate the ranking metrics on this many random "
+  "test set users, 0 for all ");
 
 volatile bool use_debugger = false;
 
@@ -70,6 +153,20 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
                 ("wait-for-debugger", ProgOpts::value<INT_T>(), wait_for_debugger_str)
                 ("similarity-cutoff-value", ProgOpts::value<FLT_T>(), similarity_cutoff_str)
                 ("max-threads-count", ProgOpts::value<INT_T>(), num_threads_str)
+                ("user-chunk-size", ProgOpts::value<INT_T>(), user_chunk_size_str)
+                ("recommendation-type", ProgOpts::value<STRING_T>(), recommendation_type_str)
+                ("user-neighbours-file-path", ProgOpts::value<STRING_T>(), user_neighbours_file_path_str)
+                ("item-neighbours-file-path", ProgOpts::value<STRING_T>(), item_neighbours_file_path_str)
+                ("recos-dir", ProgOpts::value<STRING_T>(), recos_dir_str)
+                ("reco-output-format", ProgOpts::value<STRING_T>(), reco_output_format_str)
+                ("mtx-load-mode", ProgOpts::value<STRING_T>(), mtx_load_mode_str)
+                ("test-set-file-path", ProgOpts::value<STRING_T>(), test_set_file_path_str)
+                ("ranking-cutoffs", ProgOpts::value<STRING_T>(), ranking_cutoffs_str)
+                ("sweep-top-K", ProgOpts::value<STRING_T>(), sweep_top_K_str)
+                ("sweep-cutoffs", ProgOpts::value<STRING_T>(), sweep_cutoffs_str)
+                ("relevant-rating-threshold", ProgOpts::value<FLT_T>(), relevant_rating_threshold_str)
+                ("ranking-sample-users", ProgOpts::value<INT_T>(), ranking_sample_users_str)
+                ("lazy-similarity-cache-rows", ProgOpts::value<INT_T>(), lazy_similarity_cache_rows_str)
                 ; // leave this semi colon at end don't move this
 
         ProgOpts::store(ProgOpts::parse_command_line(argc, argv, desc), varMap);
@@ -101,6 +198,23 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
         OPT(user_index_table_path, "user-index-table-path",
           STRING_T, STRING_T("/tmp/user-index-table.idx"));
         OPT(max_threads_count, "max-threads-count", INT_T, 60);
+        OPT(user_chunk_size, "user-chunk-size", INT_T, 64);
+        OPT(recommendation_type, "recommendation-type",
+          STRING_T, STRING_T("item-item"));
+        OPT(user_neighbours_file_path, "user-neighbours-file-path",
+          STRING_T, STRING_T("/tmp/user-neighbours.csr"));
+        OPT(item_neighbours_file_path, "item-neighbours-file-path",
+          STRING_T, STRING_T(""));
+        OPT(recos_dir, "recos-dir", STRING_T, STRING_T("/tmp/recos/"));
+        OPT(reco_output_format, "reco-output-format", STRING_T, STRING_T("files"));
+        OPT(mtx_load_mode, "mtx-load-mode", STRING_T, STRING_T("read"));
+        OPT(test_set_file_path, "test-set-file-path", STRING_T, STRING_T(""));
+        OPT(ranking_cutoffs, "ranking-cutoffs", STRING_T, STRING_T("5,10,20"));
+        OPT(sweep_top_K, "sweep-top-K", STRING_T, STRING_T(""));
+        OPT(sweep_cutoffs, "sweep-cutoffs", STRING_T, STRING_T(""));
+        OPT(relevant_rating_threshold, "relevant-rating-threshold", FLT_T, 4);
+        OPT(ranking_sample_users, "ranking-sample-users", INT_T, 0);
+        OPT(lazy_similarity_cache_rows, "lazy-similarity-cache-rows", INT_T, 0);
     }
     catch(exception &e)
     {
@@ -126,30 +240,44 @@ int startPredictions(int argc, char * argv[])
 
     printHeader();
 
-    FLT_T rmse = 0, numTrials = 0;
+    if(params.recommendation_type == "user-user") {
+      UserUserPredictor upred(params);
+      upred.prepareForPrediction();
+      if(params.test_set_file_path.size()) {
+        upred.evaluateTestSet();
+        upred.evaluateRanking();
+      }
+      upred.generateRecommendationsForAllUsers(params.recos_dir, 20,
+                                                params.max_threads_count);
+      return 0;
+    }
+
+    if(params.sweep_top_K.size() || params.sweep_cutoffs.size()) {
+      INT_T_VEC Ks = parseCommaList<INT_T>(params.sweep_top_K);
+      vector<FLT_T> cutoffs = parseCommaList<FLT_T>(params.sweep_cutoffs);
+      if(Ks.empty() || cutoffs.empty() || !params.test_set_file_path.size()) {
+        cout << " --sweep-top-K and --sweep-cutoffs need each other and --test-set-file-path\n";
+        return 3;
+      }
+      params.top_K_neighbours = *max_element(Ks.begin(), Ks.end());
+      params.similarity_cutoff_value = *min_element(cutoffs.begin(), cutoffs.end());
+      ItemItemPredictor ipred(params);
+      ipred.prepareForPrediction();
+      ipred.sweepParameters();
+      ipred.printLazySimilarityStats();
+      return 0;
+    }
 
     ItemItemPredictor ipred(params);
     ipred.prepareForPrediction();
-    ipred.generateRecommendationsForAllUsers(STRING_T("/tmp/recos/"), 20,
-                                              params.max_threads_count);
-
     cout << "ipred.prepareForPrediction() done " << endl;
-#if 0
-    for(int i=0; i<params.loop_mode_count; i++) {
-        try {
-          ItemItemPredictor ipred(params);
-          ipred.prepareForPrediction();
-          cout << " ipred.recommendProducts\n";
-          system("date");
-          rmse += ipred.checkCrossValidation();
-          numTrials++;
-        } catch (const char * s) {
-          cout << "Exception:: " << s << "\n";
-        }
+    if(params.test_set_file_path.size()) {
+      ipred.evaluateTestSet();
+      ipred.evaluateRanking();
     }
-    cout << " rmse " << (rmse/numTrials) << " found using "
-      << numTrials << " trials " << endl;
-#endif
+    ipred.generateRecommendationsForAllUsers(params.recos_dir, 20,
+                                              params.max_threads_count);
+    ipred.printLazySimilarityStats();
     return 0;
 }
 
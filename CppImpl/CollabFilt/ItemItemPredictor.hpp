@@ -4,18 +4,20 @@
 #define ITEMITEM_PREDICTOR_HPP
 
 #include <thread>
+#include <atomic>
 #include <ctime>
 #include <chrono>
+#include <iomanip>
+#include <sys/stat.h>
 
 #include "../utils/Utils.hpp"
-#include "../utils/Mtx.hpp"
-#include "../utils/UserItemTableHelper.hpp"
-
-typedef struct USR_RANGE_T{
-  INT_T firstUserIdx;
-  INT_T lastUserIdx;
-  USR_RANGE_T(INT_T f, INT_T l) : firstUserIdx(f), lastUserIdx(l) { }
-} USR_RANGE_T;
+#include "../utils/TriMtx.hpp"
+#include "../utils/CSRMtx.hpp"
+#include "../utils/TopN.hpp"
+#include "../utils/RecoWriter.hpp"
+#include "../utils/RatingEvaluator.hpp"
+#include "../utils/RankingEvaluator.hpp"
+#include "LazySimilarity.hpp"
 
 typedef struct SIM_RANK_T {
   INT_T itemId;
@@ -39,7 +41,23 @@ typedef struct RECO_RANK_T {
   }
 } RECO_RANK_T;
 
-typedef vector<Rating_T> RatingVector;
+// A worker thread's buffers for scoring users, kept across its user chunks
+typedef struct RECO_SCRATCH_T {
+  vector<FLT_T> num, den; // per item, all zero between users
+  INT_T_VEC touched;
+  TopNSelector topN;
+  vector<RECO_RANK_T> recoList;
+  RECO_SCRATCH_T() : topN(1) { }
+
+  void prepare(INT_T numItems, INT_T numRecommendations)
+  {
+    if(num.size() != numItems) {
+      num.assign(numItems, 0);
+      den.assign(numItems, 0);
+    }
+    topN.reset(numRecommendations);
+  }
+} RECO_SCRATCH_T;
 
 struct ItemItemPredictorParams {
   INT_T top_K_neighbours;
@@ -49,23 +67,42 @@ struct ItemItemPredictorParams {
   INT_T num_recommendations;
   FLT_T training_sample_percentage;
   FLT_T similarity_cutoff_value;
+  FLT_T relevant_rating_threshold;
+  INT_T ranking_sample_users;
+  INT_T user_chunk_size;
+  INT_T lazy_similarity_cache_rows;
 
   STRING_T csv_input_file_path;
   STRING_T sim_mtx_file_path;
   STRING_T item_index_table_path;
   STRING_T user_index_table_path;
   STRING_T recos_dir;
+  STRING_T reco_output_format;
+  STRING_T mtx_load_mode;
+  STRING_T recommendation_type;
+  STRING_T user_neighbours_file_path;
+  STRING_T item_neighbours_file_path;
+  STRING_T test_set_file_path;
+  STRING_T ranking_cutoffs;
+  STRING_T sweep_top_K;
+  STRING_T sweep_cutoffs;
 };
 
 class ItemItemPredictor {
   ItemItemPredictorParams params;
-  Mtx *similarityTable;
+  TriMtx *similarityTable;
+  // row i holds the top K neighbours of item i above the similarity
+  // cutoff, by descending similarity (so not column sorted, no find())
+  CSRMtx itemNeighbours;
+  CSRMtx neighbourOf; // transpose, row j lists the items having j as a neighbour
+  LazySimilarity *lazySims; // replaces the two above with --lazy-similarity-cache-rows
+  std::atomic<INT_T> nextNeighbourRow;
   INT_T_VEC itemIndex;
   INT_T_VEC userIndex;
   INT_T_VEC itemReverseIndex;
   INT_T_VEC userReverseIndex;
-  vector<RatingVector> itemRV; // itembased rating vector
-  vector < map<INT_T, FLT_T> > itmUsrMap; // item user
+  CSRMtx usrRatings; // user x item, coded ids
+  vector<TEST_RATING_T> testSet; // held out, left out of usrRatings
   FLT_T crossValidRMSE;
 
   template<typename T>
@@ -87,183 +124,312 @@ class ItemItemPredictor {
     }
   }
 
-  FLT_T quickPredictRating(INT_T usr, vector<SIM_RANK_T> &predictList)
+  // the neighbours of itm, most similar first. A lazily computed row is
+  // kept alive by hold while nbrs / sims are in use.
+  INT_T neighbourRow(INT_T itm, const INT_T *&nbrs, const FLT_T *&sims,
+    shared_ptr<const NEIGHBOUR_ROW_T> &hold)
   {
-    FLT_T numerator = 0, denominator = 0;
+    if(!lazySims) {
+      nbrs = itemNeighbours.rowCols(itm);
+      sims = itemNeighbours.rowVals(itm);
+      return itemNeighbours.rowSize(itm);
+    }
+    hold = lazySims->neighbours(itm);
+    nbrs = hold->items.data();
+    sims = hold->sims.data();
+    return hold->items.size();
+  }
 
-    for(int i=0; i < predictList.size(); i++) {
-      SIM_RANK_T &sr = predictList[i];
-      INT_T curItm = sr.itemId;
-      FLT_T curSim = sr.similarity;
-      FLT_T curRating = getMappedRating(usr, curItm, NAN);
+  FLT_T quickPredict(INT_T usr, INT_T itm)
+  {
+    FLT_T numerator = 0, denominator = 0;
+    const INT_T *nbrs;
+    const FLT_T *sims;
+    shared_ptr<const NEIGHBOUR_ROW_T> hold;
+    INT_T n = neighbourRow(itm, nbrs, sims, hold);
 
+    for(INT_T i=0; i < n; i++) {
+      FLT_T curRating = getMappedRating(usr, nbrs[i], NAN);
       if(isnan(curRating))
         continue;
-
-      numerator += curSim * curRating;
-      denominator += curSim;
+      numerator += sims[i] * curRating;
+      denominator += sims[i];
     }
     FLT_T rt = numerator / denominator;
     return isnan(rt) ? MIN_INVAID_RATING() : rt;
   }
 
-  FLT_T quickPredict(INT_T usr, INT_T itm)
+  // top K items of the similarity row above the cutoff, most similar first
+  void getNeighbours(const INT_T item, vector<FLT_T> &row,
+    vector<SIM_RANK_T> &simRanks)
   {
-    INT_T K = params.top_K_neighbours;
-    vector<SIM_RANK_T> simRanks, predictList;
-
     simRanks.clear();
-    getNeighbours(itm, params.similarity_cutoff_value, simRanks);
-
-    for(int i=0; i<simRanks.size(); i++) {
-      SIM_RANK_T &sr = simRanks[i];
-      // if(isnan(getRating(usr, sr.itemId)))
-      //   continue;
-      predictList.push_back(SIM_RANK_T(sr.itemId, sr.similarity));
-      if(!K--)
-        break;
+    similarityTable->copyRow(item, row.data());
+    for(INT_T c=0; c < similarityTable->cols; c++) {
+      if(c == item)
+        continue;
+      FLT_T sim = row[c];
+      if(!isnan(sim) && sim > params.similarity_cutoff_value)
+        simRanks.push_back(SIM_RANK_T(c, sim));
     }
-    return quickPredictRating(usr, predictList);
+
+    INT_T K = min((INT_T) simRanks.size(), params.top_K_neighbours);
+    partial_sort(simRanks.begin(), simRanks.begin() + K, simRanks.end(),
+      [](const SIM_RANK_T &a, const SIM_RANK_T &b) {
+        return a.similarity > b.similarity ||
+          (a.similarity == b.similarity && a.itemId < b.itemId);
+      });
+    simRanks.erase(simRanks.begin() + K, simRanks.end());
   }
 
-  // recoList contains real item ids
-  void saveRecommendationsToFileSystem(INT_T usr,
-    vector<RECO_RANK_T> &recoList, STRING_T recoDir,
-    INT_T numRecommendationsPerUser)
+  void neighbourListsThread(vector< vector<SIM_RANK_T> > &lists)
   {
-    std::ostringstream ss;
-    ss << userIndex[usr] << "_" << usr << ".reco.txt";
-    STRING_T recoFile(recoDir + string(ss.str()));
-
-    FILE *fp = fopen(recoFile.c_str(), "wb");
-    if(!fp) {
-      cout << " saveRecommendationsToFileSystem Unable to write to file "
-        << recoFile << endl;
-      return;
+    vector<FLT_T> row(similarityTable->cols);
+    for(INT_T item = nextNeighbourRow++; item < lists.size(); item = nextNeighbourRow++) {
+      getNeighbours(item, row, lists[item]);
     }
+  }
 
-    for(INT_T i = 0; i<recoList.size(); i++) {
-      std::ostringstream rs; //reco ostringstream
-      rs << recoList[i].itemId << "\n";
-      STRING_T itm(STRING_T(rs.str()));
-      size_t written = fwrite(itm.c_str(), itm.length(), 1, fp);
-
-      if(written <= 0) {
-        cout << " saveRecommendationsToFileSystem if(written <= 0) for "
-          << recoFile << endl;
-        fclose(fp);
-        return;
+  void setNeighbourLists(vector< vector<SIM_RANK_T> > &lists)
+  {
+    INT_T numItems = lists.size();
+    itemNeighbours.rows = itemNeighbours.cols = numItems;
+    itemNeighbours.rowStart = vector<long long>(numItems + 1, 0);
+    for(INT_T i=0; i<numItems; i++) {
+      itemNeighbours.rowStart[i + 1] = itemNeighbours.rowStart[i] + lists[i].size();
+    }
+    itemNeighbours.colIdx = vector<INT_T>(itemNeighbours.rowStart[numItems]);
+    itemNeighbours.vals = vector<FLT_T>(itemNeighbours.rowStart[numItems]);
+    for(INT_T i=0; i<numItems; i++) {
+      long long x = itemNeighbours.rowStart[i];
+      for(INT_T j=0; j<lists[i].size(); j++, x++) {
+        itemNeighbours.colIdx[x] = lists[i][j].itemId;
+        itemNeighbours.vals[x] = lists[i][j].similarity;
       }
+      vector<SIM_RANK_T>().swap(lists[i]);
     }
-    fclose(fp);
   }
 
-  void generateRecommendationsForUsrRange(INT_T userFirst, INT_T userLast,
-    STRING_T recoDirPath, INT_T numRecommendationsPerUser,
-    INT_T minimumRecoCutOff, UserItemTableHelper &uith, INT_T threadIndex, bool useFirstBestFit)
+  // sorts every similarity row once, predictions then walk at most K entries
+  void buildNeighbourLists()
   {
-    cout << " generateRecommendationsForAllUsrRange threadIndex "
-      << threadIndex << " started " << endl;
-    for(INT_T usr = userFirst; usr <= userLast; usr++) {
-      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  START_TIME_STAMP("ItemItemPredictor::buildNeighbourLists");
+    vector< vector<SIM_RANK_T> > lists(similarityTable->rows);
+    INT_T threadCount = poolThreadCount(params.max_threads_count);
+    nextNeighbourRow = 0;
 
-      vector<RECO_RANK_T> recoList;
-      recoList.clear();
-      INT_T maxRec = numRecommendationsPerUser;
+    vector<thread> threadList;
+    for(INT_T i=0; i<threadCount; i++) {
+      threadList.push_back(thread(&ItemItemPredictor::neighbourListsThread,
+        this, std::ref(lists)));
+    }
+    for(INT_T i=0; i<threadList.size(); i++) {
+      threadList[i].join();
+    }
+    setNeighbourLists(lists);
+  END_TIME_STAMP;
+  }
 
-      for(INT_T item = 0; item < itemIndex.size(); item++) {
-        if(uith.hasUserRatedItem(usr, item) == 1)
-          continue;
+  // lists saved by an earlier run may hold more or weaker neighbours
+  void trimNeighbourLists()
+  {
+    vector< vector<SIM_RANK_T> > lists(itemNeighbours.rows);
+    for(INT_T i=0; i<itemNeighbours.rows; i++) {
+      INT_T n = itemNeighbours.rowSize(i);
+      const INT_T *nbrs = itemNeighbours.rowCols(i);
+      const FLT_T *sims = itemNeighbours.rowVals(i);
+      for(INT_T j=0; j<n && lists[i].size() < params.top_K_neighbours; j++) {
+        if(sims[j] > params.similarity_cutoff_value)
+          lists[i].push_back(SIM_RANK_T(nbrs[j], sims[j]));
+      }
+    }
+    setNeighbourLists(lists);
+  }
 
-        FLT_T prt = quickPredict(usr, item);
-        INT_T realItemId = itemIndex[item];
+  // saved with the lists: K, cutoff, and the similarity matrix file's size
+  // and modification time they were built from
+  vector<double> neighbourListsMeta()
+  {
+    struct stat st;
+    if(stat(params.sim_mtx_file_path.c_str(), &st) != 0)
+      throw(" ItemItemPredictor similarity matrix not found, saved item neighbour "
+        "lists can not be checked against it");
+    vector<double> meta(4);
+    meta[0] = params.top_K_neighbours;
+    meta[1] = params.similarity_cutoff_value;
+    meta[2] = st.st_size;
+    meta[3] = st.st_mtime;
+    return meta;
+  }
 
-        if(prt > minimumRecoCutOff) {
-          recoList.push_back(RECO_RANK_T(realItemId, prt));
-          if(!useFirstBestFit)
-            continue;
-          if(!--maxRec)
-            break;
-          }
-      } // for(INT_T item = 0; item < itemIndex.size(); item++)
+  // Saved lists are used when built from the same similarity matrix with
+  // at least K neighbours and at most the cutoff, and cut down to K and
+  // the cutoff. Others (another matrix, shorter lists, an older file) are
+  // rebuilt and saved over.
+  void loadOrBuildNeighbourLists()
+  {
+    STRING_T &path = params.item_neighbours_file_path;
+    FILE *fp = path.size() ? fopen(path.c_str(), "rb") : 0;
+    bool loaded = false;
+    if(fp) {
+      fclose(fp);
+      cout << " ItemItemPredictor loading item neighbour lists from " << path << "\n";
+      vector<double> want = neighbourListsMeta();
+      try {
+        itemNeighbours.readFromFileSystem(path.c_str());
+      } catch (const char * s) {
+        cout << " " << s << "\n";
+        itemNeighbours = CSRMtx();
+      }
+      const vector<double> &saved = itemNeighbours.meta;
+      if(saved.size() != want.size() || saved[2] != want[2] || saved[3] != want[3])
+        cout << " saved lists are not from " << params.sim_mtx_file_path << ", rebuilding\n";
+      else if(saved[0] < want[0] || (FLT_T) saved[1] > (FLT_T) want[1])
+        cout << " saved lists hold K " << saved[0] << " above cutoff " << saved[1]
+          << ", K " << want[0] << " above " << want[1] << " asked for, rebuilding\n";
+      else if(itemNeighbours.rows != itemIndex.size())
+        cout << " saved lists do not match the item index, rebuilding\n";
+      else
+        loaded = true;
+      if(loaded && (saved[0] != want[0] || saved[1] != want[1])) {
+        cout << " cutting saved lists of K " << saved[0] << " above cutoff " << saved[1]
+          << " down to K " << want[0] << " above " << want[1] << "\n";
+        trimNeighbourLists();
+      }
+    }
+    if(!loaded) {
+      cout << " ItemItemPredictor::loadSimilarityMatrixFromFileSystem from "
+            << params.sim_mtx_file_path << "\n";
+      similarityTable = new TriMtx(params.sim_mtx_file_path.c_str(),
+        parseMtxLoadMode(params.mtx_load_mode));
+      buildNeighbourLists();
+      DELETE(similarityTable);
+      if(path.size()) {
+        cout << " ItemItemPredictor saving item neighbour lists to " << path << "\n";
+        itemNeighbours.meta = neighbourListsMeta();
+        itemNeighbours.writeToFileSystem(path.c_str());
+      }
+    }
+    cout << " item neighbour lists " << itemNeighbours.rows << " items "
+      << itemNeighbours.nnz() << " neighbours\n";
+    itemNeighbours.transpose(neighbourOf);
+  }
 
-      sort(recoList.begin(), recoList.end());
-      reverse(recoList.begin(), recoList.end()); // change to descending
+  // Scores every item the user has not rated at once: each rated item j
+  // adds s(i,j) * r(u,j) to the items i that have j among their neighbours,
+  // the same sums quickPredict builds per item, at O(|rated| * K) a user.
+  // touched collects the items that received a contribution.
+  // Lazy rows are not transposed, j's own neighbours i get s(j,i) instead:
+  // the same items while K does not cut the lists (the similarity and the
+  // cutoff are symmetric), the nearest ones to what the user rated else.
+  void scatterUserRatings(INT_T usr, vector<FLT_T> &num, vector<FLT_T> &den,
+    INT_T_VEC &touched)
+  {
+    INT_T n = usrRatings.rowSize(usr);
+    const INT_T *rated = usrRatings.rowCols(usr);
+    const FLT_T *ratings = usrRatings.rowVals(usr);
+    shared_ptr<const NEIGHBOUR_ROW_T> hold;
+
+    for(INT_T x = 0; x < n; x++) {
+      INT_T m;
+      const INT_T *items;
+      const FLT_T *sims;
+      if(lazySims) {
+        m = neighbourRow(rated[x], items, sims, hold);
+      } else {
+        m = neighbourOf.rowSize(rated[x]);
+        items = neighbourOf.rowCols(rated[x]);
+        sims = neighbourOf.rowVals(rated[x]);
+      }
+      for(INT_T y = 0; y < m; y++) {
+        INT_T itm = items[y];
+        if(den[itm] == 0)
+          touched.push_back(itm);
+        num[itm] += sims[y] * ratings[x];
+        den[itm] += sims[y];
+      }
+    }
+  }
 
-      saveRecommendationsToFileSystem(usr, recoList,
-        STRING_T(recoDirPath), numRecommendationsPerUser);
+  // top numItems unrated items above minimumRecoCutOff, coded item ids
+  void recommend(INT_T usr, FLT_T minimumRecoCutOff, vector<FLT_T> &num,
+    vector<FLT_T> &den, INT_T_VEC &touched, TopNSelector &topN,
+    vector<RECO_RANK_T> &recoList)
+  {
+    touched.clear();
+    topN.reset();
+    scatterUserRatings(usr, num, den, touched);
+
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T itm = touched[x];
+      FLT_T prt = num[itm] / den[itm];
+      if(prt > minimumRecoCutOff && !hasUserRatedItem(usr, itm))
+        topN.offer(itm, prt);
+      num[itm] = 0;
+      den[itm] = 0;
+    }
+    topN.getSorted(recoList);
+  }
 
-      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-      cout << "\n Recommendation for " << usr << " took "
-        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
-        << " milli seconds \n";
-    } // for(INT_T usr = userFirst; usr <= userLast; usr++)
+  // users [userFirst, userLast), threadIndex is also the writer shard
+  // the thread owns
+  void generateRecommendationsForUsrRange(INT_T userFirst, INT_T userLast,
+    RecoWriter &writer, INT_T minimumRecoCutOff, RECO_SCRATCH_T &sc,
+    INT_T threadIndex)
+  {
+    for(INT_T usr = userFirst; usr < userLast; usr++) {
+      recommend(usr, minimumRecoCutOff, sc.num, sc.den, sc.touched, sc.topN,
+        sc.recoList);
+      for(INT_T i = 0; i < sc.recoList.size(); i++) {
+        sc.recoList[i].itemId = itemIndex[sc.recoList[i].itemId];
+      }
+      writer.write(threadIndex, userIndex[usr], usr, sc.recoList);
+    }
   }
 
+  // A pool of at most one thread per hardware thread pulls chunks of
+  // params.user_chunk_size users from an atomic counter, so threads that
+  // get light users simply take more chunks.
   STRING_T generateRecommendationsForAllUsersThreaded(STRING_T recoDirPath,
     INT_T numRecommendationsPerUser, INT_T numThreads)
   {
     cout << " generateRecommendationsForAllUsers ..." << endl;
     INT_T totalUsers = userIndex.size();
-    INT_T usersPerThread = totalUsers/numThreads;
+    INT_T threadCount = poolThreadCount(numThreads);
+    INT_T chunkSize = max(1, params.user_chunk_size);
 
     cout << " userIndex.size() " << totalUsers << endl;
     cout << " itemIndex.size() " << itemIndex.size() << endl;
-    cout << " numThreads " << numThreads
-      << " usersPerThread " << usersPerThread << endl;
-
-    INT_T userFirst = 0;
-    INT_T userLast = 0;
-    vector<USR_RANGE_T> usrRangesList;
-
-    for(int i=0; i<numThreads; i++) {
-      userFirst = i*usersPerThread;
-      userLast = userFirst + usersPerThread - 1;
-      usrRangesList.push_back(USR_RANGE_T(userFirst, userLast));
-    }
-
-    INT_T veryLastUsr = totalUsers - 1;
-    userLast++;
-
-    if((veryLastUsr - userLast) >= 0) {
-      usrRangesList.push_back(USR_RANGE_T(userLast, veryLastUsr));
-    }
-
-    vector<thread> threadList;
-    UserItemTableHelper uith(params.csv_input_file_path);
-    uith.prepareTable();
-
-    for(int i=0; i<usrRangesList.size(); i++) {
-      USR_RANGE_T &uR = usrRangesList[i];
-      userFirst = uR.firstUserIdx;
-      userLast = uR.lastUserIdx;
-      cout << " thread num " << i << " userFirst " << userFirst
-        << " userLast " << userLast << endl;
-
-      threadList.push_back (
-        thread(
-          &ItemItemPredictor::generateRecommendationsForUsrRange,
-          this, userFirst, userLast, recoDirPath,
-          numRecommendationsPerUser, params.similarity_cutoff_value,  std::ref(uith), i, true
-        )
-      );
-      std::this_thread::sleep_for(std::chrono::milliseconds(2));
-    }
-
-    for(INT_T i=0; i<threadList.size(); i++) {
-      threadList[i].join();
-    }
+    cout << " threads " << threadCount << " (asked for " << numThreads
+      << ") users per chunk " << chunkSize << endl;
+
+    RecoWriter writer(recoDirPath, params.reco_output_format, threadCount);
+    vector<RECO_SCRATCH_T> scratch(threadCount);
+    BatchTimings timings(threadCount);
+
+    parallelForBatches(totalUsers, chunkSize, threadCount,
+      [&](long long first, long long last, INT_T t) {
+        scratch[t].prepare(itemIndex.size(), numRecommendationsPerUser);
+        timings.time(t, first, last, [&](long long f, long long l) {
+          generateRecommendationsForUsrRange(f, l, writer,
+            params.similarity_cutoff_value, scratch[t], t);
+        });
+      });
+    writer.close();
+    timings.report("generateRecommendationsForAllUsers");
 
     return STRING_T("ALL USERS");
   }
 
 public:
-  ItemItemPredictor(ItemItemPredictorParams &_params): params(_params)
+  ItemItemPredictor(ItemItemPredictorParams &_params): params(_params),
+    similarityTable(0), lazySims(0), nextNeighbourRow(0)
   {
   }
 
   ~ItemItemPredictor() {
     DELETE(similarityTable);
+    DELETE(lazySims);
   }
 
   void createReverseIndex(INT_T_VEC &vi, INT_T_VEC &revi)
@@ -276,11 +442,11 @@ public:
 
   void createReverseLookupIndexes()
   {
-    INT_T maxItemId = itemIndex[itemIndex.size() - 1];
-    INT_T maxUserId = userIndex[userIndex.size() - 1];
+    INT_T maxItemId = *max_element(itemIndex.begin(), itemIndex.end());
+    INT_T maxUserId = *max_element(userIndex.begin(), userIndex.end());
 
-    itemReverseIndex = INT_T_VEC(maxItemId + 1);
-    userReverseIndex = INT_T_VEC(maxUserId + 1);
+    itemReverseIndex = INT_T_VEC(maxItemId + 1, -1);
+    userReverseIndex = INT_T_VEC(maxUserId + 1, -1);
 
     createReverseIndex(itemIndex, itemReverseIndex);
     createReverseIndex(userIndex, userReverseIndex);
@@ -288,17 +454,13 @@ public:
 
   void loadValuesFromFileSystem()
   {
-    cout << " ItemItemPredictor::loadSimilarityMatrixFromFileSystem from "
-          << params.sim_mtx_file_path << "\n";
-    similarityTable = new Mtx(params.sim_mtx_file_path.c_str());
-
     loadVector<INT_T>(params.item_index_table_path.c_str(), itemIndex);
     loadVector<INT_T>(params.user_index_table_path.c_str(), userIndex);
   }
 
   void readInputCSV()
   {
-      INT_T userid, itemid, rating, rc = 0;
+      INT_T userid, itemid, rating, rc = 0, skipped = 0, heldOut = 0;
       FILE * csvFile = fopen (params.csv_input_file_path.c_str(), "r");
 
       if(!csvFile) {
@@ -307,60 +469,79 @@ public:
         throw(" Unable to open ratings csv input file");
       }
 
+      vector<CSR_ENTRY_T> entries;
       while(true) {
           int r = fscanf(csvFile,"%d %d %d",&userid, &itemid, &rating);
           if(r<0) {
               break;
           }
-          INT_T iid = itemReverseIndex[itemid];
-          INT_T uid = userReverseIndex[userid];
-
-          map<INT_T, FLT_T> &iuMap = itmUsrMap[iid];
-          iuMap[uid] = rating;
+          INT_T iid = lookupCodedId(itemReverseIndex, itemid);
+          INT_T uid = lookupCodedId(userReverseIndex, userid);
+          if(uid < 0 || iid < 0) {
+            skipped++;
+            continue;
+          }
+          if(isHeldOut(uid, iid)) {
+            heldOut++;
+            continue;
+          }
+          entries.push_back(CSR_ENTRY_T(uid, iid, rating));
 
           rc++;
           if((rc%5000000) == 0) {
             cout << " " << rc << " entries mapped " << endl;
           }
       }
-      cout << " total entries read  " << rc << "\n";
+      cout << " total entries read  " << rc << " skipped (not in index tables) "
+        << skipped << " held out (in the test set) " << heldOut << "\n";
       fclose(csvFile);
+
+      usrRatings = CSRMtx(userIndex.size(), itemIndex.size(), entries);
   }
 
-  // rating done by the user
+  bool isHeldOut(INT_T uid, INT_T iid)
+  {
+    return testSet.size() &&
+      binary_search(testSet.begin(), testSet.end(), TEST_RATING_T(uid, iid, 0));
+  }
+
+  void loadTestSet()
+  {
+    long long unknown = loadTestSetRatings(params.test_set_file_path.c_str(),
+      [this](INT_T u) { return lookupCodedId(userReverseIndex, u); },
+      [this](INT_T i) { return lookupCodedId(itemReverseIndex, i); },
+      testSet);
+    cout << " test set " << testSet.size() << " ratings, " << unknown
+      << " with unknown user or item ids dropped\n";
+  }
+
+  // -1 for ids the index tables do not know
+  INT_T lookupCodedId(INT_T_VEC &revi, INT_T id)
+  {
+    return (id >= 0 && id < revi.size()) ? revi[id] : -1;
+  }
+
+  // rating done by the user, binary search in the user's row
   // use coded ids for user and item ids
   FLT_T getRating(INT_T uid, INT_T iid)
   {
-    RatingVector &rv = itemRV[iid];
-    for(int i=0; i < rv.size(); i++) {
-      if(rv[i].uId == uid)
-        return rv[i].rtng;
-    }
-    return NAN;
+    return usrRatings.get(uid, iid, NAN);
   }
 
   // rating done by the user
   // use coded ids for user and item ids
   FLT_T getMappedRating(INT_T uid, INT_T iid, const FLT_T unrated = NAN)
   {
-    map<INT_T, FLT_T> &uim = itmUsrMap[iid];
-    auto uimIt = uim.find(uid);
-
-    if(uimIt != uim.end())
-      return uimIt->second;
+    return usrRatings.get(uid, iid, unrated);
+  }
 
-    return unrated;
+  bool hasUserRatedItem(INT_T uid, INT_T iid)
+  {
+    return usrRatings.find(uid, iid) >= 0;
   }
 
   void populateRatings()
   {
-    itmUsrMap = vector < map<INT_T, FLT_T> > (itemIndex.size());
-    for(int i=0; i<itmUsrMap.size(); i++) {
-      itmUsrMap[i] = map<INT_T, FLT_T>();
-    }
-
-    itemRV = vector<RatingVector>(itemIndex.size());
-
     readInputCSV();
   }
 
@@ -390,84 +571,45 @@ public:
     return iid;
   }
 
-  void getNeighbours (const INT_T item, const FLT_T similarityCutoff,
-                  vector<SIM_RANK_T> &simRanks )
-  {
-    for(INT_T c=0; c < similarityTable->cols; c++) {
-      if(c == item)
-        continue;
-
-      FLT_T sim = similarityTable->get(item, c);
-      if(isnan(sim))
-        continue;
-
-      if(sim > similarityCutoff) {
-          simRanks.push_back(SIM_RANK_T(c, sim));
-      }
-    }
-
-    sort(simRanks.begin(), simRanks.end());
-    reverse(simRanks.begin(), simRanks.end()); // change to descending
-  }
-
-  FLT_T predictRating(INT_T usr, vector<SIM_RANK_T> &predictList)
+  FLT_T predict(INT_T usr, INT_T itm)
   {
     FLT_T numerator = 0, denominator = 0;
+    const INT_T *nbrs;
+    const FLT_T *sims;
+    shared_ptr<const NEIGHBOUR_ROW_T> hold;
+    INT_T n = neighbourRow(itm, nbrs, sims, hold);
 
-    for(int i=0; i < predictList.size(); i++) {
-      SIM_RANK_T &sr = predictList[i];
-      INT_T curItm = sr.itemId;
-      FLT_T curSim = sr.similarity;
-      FLT_T curRating = getRating(usr, curItm);
+    for(INT_T i=0; i < n; i++) {
+      FLT_T curRating = getRating(usr, nbrs[i]);
       if(isnan(curRating))
         continue;
-      numerator += curSim * curRating;
-      denominator += curSim;
+      numerator += sims[i] * curRating;
+      denominator += sims[i];
     }
     FLT_T rt = numerator / denominator;
     return isnan(rt) ? MIN_INVAID_RATING() : rt;
   }
 
-  FLT_T predict(INT_T usr, INT_T itm)
-  {
-    INT_T K = params.top_K_neighbours;
-    vector<SIM_RANK_T> simRanks, predictList;
-
-    simRanks.clear();
-    getNeighbours(itm, params.similarity_cutoff_value, simRanks);
-
-    for(int i=0; i<simRanks.size(); i++) {
-      SIM_RANK_T &sr = simRanks[i];
-      // if(isnan(getRating(usr, sr.itemId)))
-      //   continue;
-      predictList.push_back(SIM_RANK_T(sr.itemId, sr.similarity));
-      if(!K--)
-        break;
-    }
-    return predictRating(usr, predictList);
-  }
-
   // returns coded indexes for items
   INT_T_VEC
   recommendProducts(INT_T user, INT_T numItems)
   {
     INT_T_VEC vItems;
     vector<RECO_RANK_T> recoList;
-    for(INT_T curItm = 0; curItm < similarityTable->cols; curItm++) {
-      if(!isnan(getRating(user, curItm)))
+    TopNSelector topN(numItems);
+    INT_T considered = 0;
+    for(INT_T curItm = 0; curItm < itemIndex.size(); curItm++) {
+      if(hasUserRatedItem(user, curItm))
         continue;
-      FLT_T rt = predict(user, curItm);
-      recoList.push_back(RECO_RANK_T(curItm, rt));
+      topN.offer(curItm, predict(user, curItm));
+      considered++;
     }
-    sort(recoList.begin(), recoList.end());
-    reverse(recoList.begin(), recoList.end()); // change to descending
+    topN.getSorted(recoList);
     cout << " ItemItemPredictor::recommendProducts:: considered "
-      << recoList.size() << " comparisons\n";
+      << considered << " comparisons\n";
 
     for(INT_T i=0; i<recoList.size(); i++) {
       vItems.push_back(recoList[i].itemId);
-      if(!numItems--)
-        break;
     }
     return vItems;
   }
@@ -477,80 +619,196 @@ public:
     cout << " ItemItemPredictor::prepareForPrediction started\n";
     cout << " about to loadValuesFromFileSystem \n";
     loadValuesFromFileSystem();
+    if(params.lazy_similarity_cache_rows <= 0)
+      loadOrBuildNeighbourLists();
     cout << " about to createReverseLookupIndexes \n";
     createReverseLookupIndexes();
     cout << " about to createReverseLookupIndexes \n";
+    if(params.test_set_file_path.size())
+      loadTestSet();
     populateRatings();
+    if(params.lazy_similarity_cache_rows > 0) {
+      cout << " ItemItemPredictor similarity rows computed on demand, at most "
+        << params.lazy_similarity_cache_rows << " cached\n";
+      lazySims = new LazySimilarity(usrRatings, params.top_K_neighbours,
+        params.similarity_cutoff_value, params.lazy_similarity_cache_rows);
+    }
   }
 
-#if 0
-  FLT_T checkCrossValidation(INT_T numSamples = 10000,
-    const char *path = "/tmp/testSetRatingsList.RatingEntry") {
-      crossValidRMSE = 235;
-
-      FILE * fp = fopen(path, "rb");
-      if(!fp) {
-        throw ("ItemItemPredictor::checkCrossValidation !fp");
-      }
-
-      INT_T numEntries = -1;
-      //testSetRatingsList.size();
-
-      size_t sz = fread(&numEntries, sizeof(INT_T), 1, fp);
-      if(sz != 1) {
-        throw ("ItemItemPredictor::checkCrossValidation sz!=1");
-      }
-
-      sz = 0;
-      vector<RatingEntry> vre;
-      for(INT_T i=0; i<numEntries; i++) {
-        RatingEntry re;
-        sz = fread(&re, sizeof(RatingEntry), 1, fp);
-        //cout << "" << re.user_id << "," << re.item_id << "," << re.rating << endl;
-        vre.push_back(re);
-      }
-
-      fclose(fp);
-      INT_T maxItm = itemIndex[itemIndex.size()-1];
-      INT_T maxUsr = userIndex[userIndex.size()-1];
-      INT_T N = 0;
-      FLT_T diff_sq_sum = 0;
+  void printLazySimilarityStats()
+  {
+    if(lazySims)
+      lazySims->printStats();
+  }
 
-      INT_T_VEC randomIndexList = getRandomShuffledIndexes(vre.size(), 0, numSamples);
+  // RMSE / MAE over the test set, items without a rated neighbour
+  // are skipped
+  EVAL_RESULT_T evaluateTestSet()
+  {
+    START_TIME_STAMP("ItemItemPredictor::evaluateTestSet");
+    EVAL_RESULT_T res = evaluateRatings(testSet,
+      [this](INT_T u, INT_T i) {
+        FLT_T rt = quickPredict(u, i);
+        return rt == MIN_INVAID_RATING() ? (FLT_T) NAN : rt;
+      }, poolThreadCount(params.max_threads_count));
+
+    res.print("test set");
+    crossValidRMSE = res.rmse;
+    END_TIME_STAMP;
+    return res;
+  }
 
-      for(int j=0; j<randomIndexList.size(); j++) {
-        INT_T randomIndex = randomIndexList[j];
-        //cout << " randomIndex " << randomIndex << endl;
+  // precision / recall / NDCG / coverage of the top N lists of the test
+  // set users for every N of --ranking-cutoffs, held out items rated at
+  // least relevant_rating_threshold are the relevant ones
+  vector<RANK_RESULT_T> evaluateRanking()
+  {
+    START_TIME_STAMP("ItemItemPredictor::evaluateRanking");
+    RELEVANT_ITEMS_T rel;
+    groupRelevantItems(testSet, params.relevant_rating_threshold, rel);
+    sampleRelevantUsers(rel, params.ranking_sample_users);
+
+    INT_T threadCount = poolThreadCount(params.max_threads_count);
+    vector<RECO_SCRATCH_T> scratch(threadCount);
+
+    vector<RANK_RESULT_T> results = ::evaluateRanking(rel,
+      parseCommaList<INT_T>(params.ranking_cutoffs), itemIndex.size(),
+      [&](INT_T usr, INT_T maxN, INT_T t, INT_T_VEC &out) {
+        RECO_SCRATCH_T &sc = scratch[t];
+        sc.prepare(itemIndex.size(), maxN);
+        recommend(usr, 0, sc.num, sc.den, sc.touched, sc.topN, sc.recoList);
+        for(INT_T i = 0; i < sc.recoList.size(); i++)
+          out.push_back(sc.recoList[i].itemId);
+      }, threadCount);
+
+    for(INT_T n = 0; n < results.size(); n++)
+      results[n].print("item-item");
+    END_TIME_STAMP;
+    return results;
+  }
 
-        INT_T uid = vre[randomIndex].user_id;
-        INT_T iid = vre[randomIndex].item_id;
-        FLT_T rtg = vre[randomIndex].rating;
+  // Test set RMSE / MAE of every (K, cutoff) of the sweep_top_K x
+  // sweep_cutoffs grid in one pass. The neighbour lists must have been
+  // built with the largest K and the smallest cutoff: a list is sorted by
+  // descending similarity, so (K, cutoff) uses its first min(K, number of
+  // neighbours above cutoff) entries, and the prefix sums of one walk give
+  // the prediction of every cell. grid[k * cutoffs + c]
+  vector<EVAL_RESULT_T> sweepParameters()
+  {
+    START_TIME_STAMP("ItemItemPredictor::sweepParameters");
+    INT_T_VEC Ks = parseCommaList<INT_T>(params.sweep_top_K);
+    vector<FLT_T> cutoffs = parseCommaList<FLT_T>(params.sweep_cutoffs);
+    sort(Ks.begin(), Ks.end());
+    sort(cutoffs.begin(), cutoffs.end());
+    if(Ks.empty() || cutoffs.empty())
+      throw("ItemItemPredictor::sweepParameters empty K or cutoff list");
+    if(Ks.back() > params.top_K_neighbours || cutoffs[0] < params.similarity_cutoff_value)
+      throw("ItemItemPredictor::sweepParameters --top-K-neighbours below the largest "
+        "swept K or --similarity-cutoff-value above the smallest swept cutoff");
+    INT_T numCells = Ks.size() * cutoffs.size();
+
+    typedef struct PARTIAL_T {
+      vector<double> sse, sae;
+      vector<long long> count, skipped;
+      vector<FLT_T> num, den; // prefix sums over the list, [0] = 0
+      INT_T_VEC above;        // neighbours above each cutoff
+    } PARTIAL_T;
+    INT_T threadCount = poolThreadCount(params.max_threads_count);
+    vector<PARTIAL_T> partial(threadCount);
+    for(INT_T t = 0; t < threadCount; t++) {
+      PARTIAL_T &p = partial[t];
+      p.sse.assign(numCells, 0);
+      p.sae.assign(numCells, 0);
+      p.count.assign(numCells, 0);
+      p.skipped.assign(numCells, 0);
+      p.above.assign(cutoffs.size(), 0);
+    }
 
-        if(uid > maxUsr || iid > maxItm)
-          continue;
+    parallelForBatches(testSet.size(), 4096, threadCount,
+      [&](long long first, long long last, INT_T t) {
+        PARTIAL_T &p = partial[t];
+        for(long long x = first; x < last; x++) {
+          const TEST_RATING_T &tr = testSet[x];
+          const INT_T *nbrs;
+          const FLT_T *sims;
+          shared_ptr<const NEIGHBOUR_ROW_T> hold;
+          INT_T n = min(neighbourRow(tr.itm, nbrs, sims, hold), Ks.back());
+
+          p.num.resize(n + 1);
+          p.den.resize(n + 1);
+          p.num[0] = p.den[0] = 0;
+          for(INT_T j = 0; j < n; j++) {
+            FLT_T curRating = getMappedRating(tr.usr, nbrs[j], NAN);
+            p.num[j+1] = p.num[j];
+            p.den[j+1] = p.den[j];
+            if(isnan(curRating))
+              continue;
+            p.num[j+1] += sims[j] * curRating;
+            p.den[j+1] += sims[j];
+          }
+          INT_T j = n;
+          for(INT_T c = 0; c < cutoffs.size(); c++) {
+            while(j > 0 && !(sims[j-1] > cutoffs[c]))
+              j--;
+            p.above[c] = j;
+          }
 
-        FLT_T rt = predict(getCodedUserID(uid), getCodedItemID(iid));
-        if(isnan(rt)) {
-          cout << " isnan(rt)\n";
-          continue;
+          for(INT_T k = 0; k < Ks.size(); k++) {
+            for(INT_T c = 0; c < cutoffs.size(); c++) {
+              INT_T m = min(Ks[k], p.above[c]);
+              INT_T cell = k * cutoffs.size() + c;
+              FLT_T rt = p.num[m] / p.den[m];
+              if(isnan(rt)) {
+                p.skipped[cell]++;
+                continue;
+              }
+              double e = tr.rating - rt;
+              p.sse[cell] += e * e;
+              p.sae[cell] += fabs(e);
+              p.count[cell]++;
+            }
+          }
         }
-        FLT_T diff = rtg - rt;
-        diff_sq_sum += (diff * diff);
-        N++;
-
-        if(N%1000 == 0)
-          cout << " Predicted " << N << " ratings so far "
-          << " current rmse " << sqrt(diff_sq_sum/N)  << endl;
-        // cout << " orig: " << rtg << " pred: " << rt << " diff: " << diff << endl;
+      });
+
+    vector<EVAL_RESULT_T> grid(numCells);
+    for(INT_T cell = 0; cell < numCells; cell++) {
+      double sse = 0, sae = 0;
+      for(INT_T t = 0; t < threadCount; t++) {
+        sse += partial[t].sse[cell];
+        sae += partial[t].sae[cell];
+        grid[cell].count += partial[t].count[cell];
+        grid[cell].skipped += partial[t].skipped[cell];
+      }
+      if(grid[cell].count) {
+        grid[cell].rmse = sqrt(sse / grid[cell].count);
+        grid[cell].mae = sae / grid[cell].count;
       }
+    }
 
-      FLT_T rmse = sqrt(diff_sq_sum/N);
-      cout << " rmse " << rmse
-        << " calculated for " << N << " items "<< endl;
-      crossValidRMSE = rmse;
-      return crossValidRMSE;
+    INT_T best = 0;
+    cout << " sweep over " << testSet.size() << " test ratings, rmse / mae / predicted\n";
+    cout << "        K \\ cutoff";
+    for(INT_T c = 0; c < cutoffs.size(); c++)
+      cout << " " << setw(22) << cutoffs[c];
+    cout << "\n";
+    for(INT_T k = 0; k < Ks.size(); k++) {
+      cout << " " << setw(16) << Ks[k];
+      for(INT_T c = 0; c < cutoffs.size(); c++) {
+        EVAL_RESULT_T &res = grid[k * cutoffs.size() + c];
+        std::ostringstream cell;
+        cell << setprecision(4) << res.rmse << "/" << res.mae << "/" << res.count;
+        cout << " " << setw(22) << cell.str();
+        if(isnan(grid[best].rmse) || res.rmse < grid[best].rmse)
+          best = k * cutoffs.size() + c;
+      }
+      cout << "\n";
+    }
+    cout << " lowest rmse " << grid[best].rmse << " at K " << Ks[best / cutoffs.size()]
+      << " cutoff " << cutoffs[best % cutoffs.size()] << "\n";
+    END_TIME_STAMP;
+    return grid;
   }
-#endif
 
   STRING_T generateRecommendationsForAllUsers(STRING_T recoDirPath, INT_T numRecommendationsPerUser,
         INT_T max_threads_count)
@@ -0,0 +1,228 @@
+#ifndef LAZY_SIMILARITY_HPP
+#define LAZY_SIMILARITY_HPP
+
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "../utils/Utils.hpp"
+#include "../utils/CSRMtx.hpp"
+
+// Top K neighbours of one item, most similar first
+typedef struct NEIGHBOUR_ROW_T {
+  INT_T_VEC items;
+  vector<FLT_T> sims;
+} NEIGHBOUR_ROW_T;
+
+// Item neighbour lists computed from the ratings when first asked for,
+// instead of from a precomputed similarity matrix. The similarity is the
+// learner's adjusted cosine (ratings centered on the item mean, 0 for
+// fewer than two co-raters, summed in user order), so the rows match the
+// ones ItemItemPredictor builds from the learner's matrix.
+//
+// One row costs O(sum of the item's raters' rating counts): every co-rated
+// item is reached through the user-major ratings and its sums collected in
+// a dense per thread accumulator, no pairwise intersections.
+//
+// Rows are kept in a cache of at most maxCachedRows rows, split into
+// shards by item id, each with its own mutex and CLOCK eviction. A row is
+// handed out as a shared_ptr so eviction never frees a row in use.
+class LazySimilarity {
+  typedef struct SHARD_T {
+    mutex lock;
+    INT_T_VEC resident; // items cached in this shard
+    INT_T hand;         // CLOCK hand into resident
+    INT_T capacity;
+    SHARD_T() : hand(0), capacity(1) { }
+  } SHARD_T;
+
+  const CSRMtx &usrRatings; // user x item, coded ids
+  CSRMtx itmRatings;        // item x user
+  vector<FLT_T> itemMean;
+  INT_T topK;
+  FLT_T cutoff;
+
+  vector< shared_ptr<const NEIGHBOUR_ROW_T> > rows;
+  vector<char> referenced;
+  vector<SHARD_T> shards;
+  std::atomic<long long> hits, misses, evictions;
+
+  SHARD_T & shardOf(INT_T item) { return shards[item % shards.size()]; }
+
+  // caller holds the shard's lock
+  void evictOne(SHARD_T &s)
+  {
+    while(true) {
+      if(s.hand >= s.resident.size())
+        s.hand = 0;
+      INT_T item = s.resident[s.hand];
+      if(referenced[item]) {
+        referenced[item] = 0;
+        s.hand++;
+        continue;
+      }
+      rows[item].reset();
+      s.resident[s.hand] = s.resident.back();
+      s.resident.pop_back();
+      evictions++;
+      return;
+    }
+  }
+
+public:
+  LazySimilarity(const CSRMtx &_usrRatings, INT_T _topK, FLT_T _cutoff,
+    INT_T maxCachedRows, INT_T numShards = 64) :
+    usrRatings(_usrRatings), topK(_topK), cutoff(_cutoff),
+    rows(_usrRatings.cols), referenced(_usrRatings.cols, 0),
+    shards(max(1, min(numShards, maxCachedRows))), hits(0), misses(0), evictions(0)
+  {
+    usrRatings.transpose(itmRatings);
+    INT_T numShardsUsed = shards.size();
+    for(INT_T s = 0; s < numShardsUsed; s++)
+      shards[s].capacity = max(1, maxCachedRows / numShardsUsed +
+        (s < maxCachedRows % numShardsUsed ? 1 : 0));
+
+    itemMean = vector<FLT_T>(itmRatings.rows, 0);
+    for(INT_T i = 0; i < itmRatings.rows; i++) {
+      INT_T n = itmRatings.rowSize(i);
+      const FLT_T *r = itmRatings.rowVals(i);
+      FLT_T sum = 0;
+      for(INT_T x = 0; x < n; x++)
+        sum += r[x];
+      itemMean[i] = sum / n;
+    }
+  }
+
+  // Accumulators of computeRow, one set per thread reused across rows.
+  // The dense arrays are all zero between rows, a row resets only the
+  // entries it touched.
+  typedef struct ROW_SCRATCH_T {
+    vector<FLT_T> num, sq1, sq2;
+    INT_T_VEC count, touched;
+    vector< pair<FLT_T, INT_T> > ranks;
+  } ROW_SCRATCH_T;
+
+  // the similarity row of item, top K above the cutoff like
+  // ItemItemPredictor::getNeighbours
+  void computeRow(INT_T item, NEIGHBOUR_ROW_T &row)
+  {
+    static thread_local ROW_SCRATCH_T sc;
+    INT_T numItems = itmRatings.rows;
+    if(sc.count.size() < numItems) {
+      sc.num.resize(numItems, 0);
+      sc.sq1.resize(numItems, 0);
+      sc.sq2.resize(numItems, 0);
+      sc.count.resize(numItems, 0);
+    }
+    FLT_T *num = sc.num.data(), *sq1 = sc.sq1.data(), *sq2 = sc.sq2.data();
+    INT_T *count = sc.count.data();
+    INT_T_VEC &touched = sc.touched;
+    touched.clear();
+
+    INT_T n = itmRatings.rowSize(item);
+    const INT_T *raters = itmRatings.rowCols(item);
+    const FLT_T *ratings = itmRatings.rowVals(item);
+    for(INT_T x = 0; x < n; x++) {
+      FLT_T s1 = ratings[x] - itemMean[item];
+      INT_T u = raters[x];
+      INT_T m = usrRatings.rowSize(u);
+      const INT_T *items = usrRatings.rowCols(u);
+      const FLT_T *uRatings = usrRatings.rowVals(u);
+      for(INT_T y = 0; y < m; y++) {
+        INT_T j = items[y];
+        if(j == item)
+          continue;
+        FLT_T s2 = uRatings[y] - itemMean[j];
+        if(count[j]++ == 0)
+          touched.push_back(j);
+        num[j] += s1 * s2;
+        sq1[j] += s1 * s1;
+        sq2[j] += s2 * s2;
+      }
+    }
+
+    vector< pair<FLT_T, INT_T> > &ranks = sc.ranks;
+    ranks.clear();
+    auto rank = [&](INT_T j) {
+      FLT_T sim = 0;
+      if(count[j] > 1)
+        sim = num[j] / (sqrt(sq1[j]) * sqrt(sq2[j]));
+      if(!isnan(sim) && sim > cutoff)
+        ranks.push_back(make_pair(sim, j));
+    };
+    // items without co-raters have similarity 0, only a negative cutoff
+    // lets those in
+    if(cutoff < 0) {
+      for(INT_T j = 0; j < numItems; j++) {
+        if(j != item)
+          rank(j);
+      }
+    } else {
+      for(INT_T x = 0; x < touched.size(); x++)
+        rank(touched[x]);
+    }
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T j = touched[x];
+      num[j] = sq1[j] = sq2[j] = 0;
+      count[j] = 0;
+    }
+
+    INT_T K = min((INT_T) ranks.size(), topK);
+    partial_sort(ranks.begin(), ranks.begin() + K, ranks.end(),
+      [](const pair<FLT_T, INT_T> &a, const pair<FLT_T, INT_T> &b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+      });
+    row.items.resize(K);
+    row.sims.resize(K);
+    for(INT_T k = 0; k < K; k++) {
+      row.sims[k] = ranks[k].first;
+      row.items[k] = ranks[k].second;
+    }
+  }
+
+  // computed on a miss outside the shard lock, two threads missing the
+  // same item both compute it and the first one in is kept
+  shared_ptr<const NEIGHBOUR_ROW_T> neighbours(INT_T item)
+  {
+    SHARD_T &s = shardOf(item);
+    {
+      lock_guard<mutex> lock(s.lock);
+      if(rows[item]) {
+        referenced[item] = 1;
+        hits++;
+        return rows[item];
+      }
+    }
+
+    misses++;
+    shared_ptr<NEIGHBOUR_ROW_T> row(new NEIGHBOUR_ROW_T());
+    computeRow(item, *row);
+
+    lock_guard<mutex> lock(s.lock);
+    if(rows[item])
+      return rows[item];
+    if(s.resident.size() >= s.capacity)
+      evictOne(s);
+    rows[item] = row;
+    referenced[item] = 0;
+    s.resident.push_back(item);
+    return row;
+  }
+
+  void printStats()
+  {
+    long long cached = 0, capacity = 0;
+    for(INT_T s = 0; s < shards.size(); s++) {
+      cached += shards[s].resident.size();
+      capacity += shards[s].capacity;
+    }
+    cout << " LazySimilarity rows computed " << misses << " cache hits " << hits
+      << " evictions " << evictions << " rows cached " << cached
+      << " of at most " << capacity << "\n";
+  }
+};
+
+#endif // LAZY_SIMILARITY_HPP
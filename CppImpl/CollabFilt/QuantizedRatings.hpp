@@ -0,0 +1,141 @@
+#ifndef QUANTIZED_RATINGS_HPP
+#define QUANTIZED_RATINGS_HPP
+
+#include <cmath>
+#include <cstdint>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../utils/Utils.hpp"
+
+// Sums over the users that rated both items, in quantized units
+typedef struct Q8_DOT_T {
+  long long numerator; // sum(q1 * q2)
+  long long sq1, sq2;  // sum(q1 * q1), sum(q2 * q2)
+  INT_T count;         // co-raters
+  Q8_DOT_T() : numerator(0), sq1(0), sq2(0), count(0) { }
+} Q8_DOT_T;
+
+// Mean centered ratings stored as int8 per item, indexed by coded user id,
+// q = round(rating / scale) with scale = max|rating| / 127 of the item.
+// A rated entry never quantizes to 0 (it is nudged to +-1) so q != 0 marks
+// the raters and the co-rater sums need no bitset. The scale cancels out
+// of cosine style similarities so only the int sums are needed.
+class QuantizedItemRatings {
+  static const INT_T LANES = 32;  // int8 values per AVX2 register
+  static const INT_T BLOCK = 65536; // int32 sums stay below 2^31 per block
+
+  vector< vector<int8_t> > q;
+  vector<FLT_T> scale;
+  vector<INT_T> firstUsr;
+
+  static void dotScalar(const int8_t *a, const int8_t *b, INT_T n, Q8_DOT_T &d)
+  {
+    for(INT_T x = 0; x < n; x++) {
+      INT_T qa = a[x], qb = b[x];
+      if(!qa || !qb)
+        continue;
+      d.numerator += qa * qb;
+      d.sq1 += qa * qa;
+      d.sq2 += qb * qb;
+      d.count++;
+    }
+  }
+
+#ifdef __AVX2__
+  static long long hsum(__m256i v)
+  {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+  }
+
+  // pmaddubsw multiplies unsigned by signed bytes, |a| * sign(b, a) == a * b
+  static void dotAVX2(const int8_t *a, const int8_t *b, INT_T n, Q8_DOT_T &d)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    for(INT_T start = 0; start < n; start += BLOCK) {
+      INT_T end = min(n, start + BLOCK);
+      __m256i num = zero, sq1 = zero, sq2 = zero;
+      for(INT_T x = start; x < end; x += LANES) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + x));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + x));
+        __m256i both = _mm256_andnot_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(va, zero), _mm256_cmpeq_epi8(vb, zero)),
+          _mm256_set1_epi8(-1));
+        __m256i ma = _mm256_abs_epi8(_mm256_and_si256(va, both));
+        __m256i mb = _mm256_abs_epi8(_mm256_and_si256(vb, both));
+
+        __m256i p = _mm256_maddubs_epi16(_mm256_abs_epi8(va), _mm256_sign_epi8(vb, va));
+        num = _mm256_add_epi32(num, _mm256_madd_epi16(p, ones16));
+        sq1 = _mm256_add_epi32(sq1, _mm256_madd_epi16(_mm256_maddubs_epi16(ma, ma), ones16));
+        sq2 = _mm256_add_epi32(sq2, _mm256_madd_epi16(_mm256_maddubs_epi16(mb, mb), ones16));
+        d.count += __builtin_popcount(_mm256_movemask_epi8(both));
+      }
+      d.numerator += hsum(num);
+      d.sq1 += hsum(sq1);
+      d.sq2 += hsum(sq2);
+    }
+  }
+#endif
+
+public:
+  QuantizedItemRatings() { }
+
+  // quickRating is indexed by coded user and holds rating - item average,
+  // rv lists the raters sorted by user id
+  void addItem(vector<FLT_T> &quickRating, RatingVector &rv)
+  {
+    FLT_T maxAbs = 0;
+    for(INT_T x = 0; x < rv.size(); x++)
+      maxAbs = max(maxAbs, (FLT_T) fabs(quickRating[rv[x].uId]));
+    FLT_T s = maxAbs > 0 ? maxAbs / 127 : 1;
+
+    INT_T padded = (quickRating.size() + LANES - 1) / LANES * LANES;
+    vector<int8_t> qi(padded, 0);
+    for(INT_T x = 0; x < rv.size(); x++) {
+      FLT_T v = quickRating[rv[x].uId];
+      INT_T qv = (INT_T) lrintf(v / s);
+      qv = max(-127, min(127, qv));
+      if(qv == 0)
+        qv = v < 0 ? -1 : 1;
+      qi[rv[x].uId] = (int8_t) qv;
+    }
+
+    q.push_back(vector<int8_t>());
+    q.back().swap(qi);
+    scale.push_back(s);
+    firstUsr.push_back(rv.size() ? rv[0].uId : 0);
+  }
+
+  INT_T size() { return q.size(); }
+  FLT_T getScale(INT_T itm) { return scale[itm]; }
+
+  long long memoryBytes()
+  {
+    long long b = 0;
+    for(INT_T i = 0; i < q.size(); i++)
+      b += q[i].size();
+    return b;
+  }
+
+  Q8_DOT_T dot(INT_T i1, INT_T i2)
+  {
+    Q8_DOT_T d;
+    INT_T lo = max(firstUsr[i1], firstUsr[i2]) / LANES * LANES;
+    INT_T hi = min(q[i1].size(), q[i2].size());
+    if(hi <= lo)
+      return d;
+#ifdef __AVX2__
+    dotAVX2(q[i1].data() + lo, q[i2].data() + lo, hi - lo, d);
+#else
+    dotScalar(q[i1].data() + lo, q[i2].data() + lo, hi - lo, d);
+#endif
+    return d;
+  }
+};
+
+#endif // QUANTIZED_RATINGS_HPP
@@ -0,0 +1,167 @@
+// Author: Senthil Kumar Thangavelu kingjuliyen@gmail.com
+
+/*
+  Compile:
+  g++  SessionRecommender.cpp \
+       -I/opt/boost/1_61_0/include/ \
+       -L/opt/boost/1_61_0/lib \
+       -lboost_program_options \
+       -O3 \
+       -o /tmp/session-recommender \
+       -std=c++11
+
+  Usage:
+  Needs the item neighbour lists saved by a run of
+  /tmp/itemitem-predictor ... --item-neighbours-file-path /tmp/itm-neighbours.csr
+
+  One session:
+  /tmp/session-recommender \
+        --item-neighbours-file-path /tmp/itm-neighbours.csr \
+        --item-index-table-path /tmp/itm.idx \
+        --num-recommendations 10 \
+        --session-items 6066,4972,11701
+
+  Without --session-items sessions are read from stdin, one per line as
+  space or comma separated item ids, and answered on stdout as
+  "item,item,... -> reco,reco,...". The latency of every call is collected
+  and its distribution printed at the end.
+*/
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include "SessionRecommender.hpp"
+
+namespace ProgOpts = boost::program_options;
+
+struct SessionRecommenderParams {
+  INT_T top_K_neighbours;
+  INT_T num_recommendations;
+  FLT_T similarity_cutoff_value;
+  STRING_T item_neighbours_file_path;
+  STRING_T item_index_table_path;
+  STRING_T session_items;
+};
+
+STRPTR(item_neighbours_file_path_str, "Path of the per item top K neighbour lists "
+  "saved by itemitem-predictor ");
+STRPTR(item_index_table_path_str, "Item's index lookup table path to load from ");
+STRPTR(top_K_neighbours_str, "Use at most this many neighbours of each session item ");
+STRPTR(similarity_cutoff_str, "Use neighbours only if more similar than this cutoff ");
+STRPTR(num_recommendations_str, "Number of items to recommend ");
+STRPTR(session_items_str, "Comma separated item ids of one session, sessions are "
+  "read from stdin when not given ");
+
+bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
+                      SessionRecommenderParams &params)
+{
+    try {
+        ProgOpts::options_description desc("Allowed Options");
+
+        desc.add_options()
+                ("help", "produce help message")
+                ("item-neighbours-file-path", ProgOpts::value<STRING_T>(), item_neighbours_file_path_str)
+                ("item-index-table-path", ProgOpts::value<STRING_T>(), item_index_table_path_str)
+                ("top-K-neighbours", ProgOpts::value<INT_T>(), top_K_neighbours_str)
+                ("similarity-cutoff-value", ProgOpts::value<FLT_T>(), similarity_cutoff_str)
+                ("num-recommendations", ProgOpts::value<INT_T>(), num_recommendations_str)
+                ("session-items", ProgOpts::value<STRING_T>(), session_items_str)
+                ; // leave this semi colon at end don't move this
+
+        ProgOpts::store(ProgOpts::parse_command_line(argc, argv, desc), varMap);
+        ProgOpts::notify(varMap);
+
+        if (varMap.count("help")) {
+            cout << desc << "\n";
+            return false;
+        }
+
+        OPT(item_neighbours_file_path, "item-neighbours-file-path",
+          STRING_T, STRING_T("/tmp/itm-neighbours.csr"));
+        OPT(item_index_table_path, "item-index-table-path",
+          STRING_T, STRING_T("/tmp/item-index-table.idx"));
+        OPT(top_K_neighbours, "top-K-neighbours", INT_T, INT_T_MAX());
+        OPT(similarity_cutoff_value, "similarity-cutoff-value", FLT_T, 0);
+        OPT(num_recommendations, "num-recommendations", INT_T, 10);
+        OPT(session_items, "session-items", STRING_T, STRING_T(""));
+    }
+    catch(exception &e)
+    {
+        cerr << "\n processInputArgs error: " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+void printRecos(const INT_T_VEC &session, const vector<SESSION_RECO_T> &recos)
+{
+    for(INT_T i = 0; i < session.size(); i++)
+      cout << (i ? "," : "") << session[i];
+    cout << " ->";
+    for(INT_T i = 0; i < recos.size(); i++)
+      cout << (i ? "," : " ") << recos[i].itemId;
+    cout << "\n";
+}
+
+int startSessions(int argc, char * argv[])
+{
+    ProgOpts::variables_map vmp; // varmap
+    SessionRecommenderParams params;
+
+    if(!processInputArgs(argc, argv, vmp, params))
+       return 3;
+
+    SessionModel model(params.item_neighbours_file_path.c_str(),
+      params.item_index_table_path.c_str(), params.top_K_neighbours,
+      params.similarity_cutoff_value);
+    SessionRecommender recommender(model, params.num_recommendations);
+
+    if(params.session_items.size()) {
+      INT_T_VEC session = parseCommaList<INT_T>(params.session_items);
+      printRecos(session, recommender.recommend(session.data(), session.size(),
+        params.num_recommendations));
+      return 0;
+    }
+
+    vector<double> latencyUs;
+    INT_T_VEC session;
+    STRING_T line;
+    while(getline(cin, line)) {
+      replace(line.begin(), line.end(), ',', ' ');
+      std::istringstream ss(line);
+      session.clear();
+      for(INT_T id; ss >> id; )
+        session.push_back(id);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      const vector<SESSION_RECO_T> &recos = recommender.recommend(session.data(),
+        session.size(), params.num_recommendations);
+      latencyUs.push_back(std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count());
+      printRecos(session, recos);
+    }
+
+    if(latencyUs.size()) {
+      sort(latencyUs.begin(), latencyUs.end());
+      double sum = 0;
+      for(INT_T i = 0; i < latencyUs.size(); i++)
+        sum += latencyUs[i];
+      cerr << " " << latencyUs.size() << " sessions, latency micro seconds avg "
+        << sum / latencyUs.size() << " median " << latencyUs[latencyUs.size() / 2]
+        << " p99 " << latencyUs[(latencyUs.size() - 1) * 99 / 100]
+        << " max " << latencyUs.back() << "\n";
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    try {
+      return startSessions(argc, argv);
+    } catch (const char * s) {
+      cout << "Exception:: " << s << "\n";
+    }
+    return 1;
+}
@@ -0,0 +1,169 @@
+#ifndef SESSION_RECOMMENDER_HPP
+#define SESSION_RECOMMENDER_HPP
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include "../utils/Utils.hpp"
+#include "../utils/CSRMtx.hpp"
+#include "../utils/TopN.hpp"
+
+// Item-item recommendations for a bare list of items (an anonymous
+// session, a basket, ...) with no user in the training csv. Each session
+// item j adds w(j) * s(j,i) to every item i in its neighbour list, the
+// session items themselves are never recommended.
+//
+// SessionModel holds the neighbour lists and is read only once loaded, one
+// instance is shared by all threads. Every thread serving requests owns a
+// SessionRecommender whose buffers are sized for the whole catalog up
+// front, so recommend() does not allocate.
+
+// The per item top K lists ItemItemPredictor saves with
+// --item-neighbours-file-path, and its item index table
+class SessionModel {
+public:
+  CSRMtx itemNeighbours;      // row j lists the neighbours of item j
+  INT_T_VEC itemIndex;        // coded -> real item id
+  INT_T_VEC itemReverseIndex; // real -> coded item id, -1 if unknown
+
+  // keeps the first topK neighbours above cutoff of every list, the lists
+  // are stored most similar first
+  SessionModel(const char *neighboursPath, const char *itemIndexPath,
+    INT_T topK, FLT_T cutoff)
+  {
+    loadItemIndex(itemIndexPath);
+    CSRMtx lists(neighboursPath);
+    if(lists.rows != itemIndex.size())
+      throw(" SessionModel item neighbour lists and item index do not match");
+    // meta is ItemItemPredictor's K, cutoff, ... the lists were built with
+    if(lists.meta.size() >= 2) {
+      cout << " SessionModel lists built with K " << lists.meta[0]
+        << " cutoff " << lists.meta[1] << "\n";
+      if((topK != INT_T_MAX() && topK > lists.meta[0]) || cutoff < (FLT_T) lists.meta[1])
+        cerr << " SessionModel lists are shorter than --top-K-neighbours "
+          << topK << " above " << cutoff << " asks for\n";
+    }
+
+    vector<CSR_ENTRY_T> entries;
+    for(INT_T j = 0; j < lists.rows; j++) {
+      INT_T n = lists.rowSize(j), kept = 0;
+      const INT_T *nbrs = lists.rowCols(j);
+      const FLT_T *sims = lists.rowVals(j);
+      for(INT_T x = 0; x < n && kept < topK; x++) {
+        if(sims[x] > cutoff) {
+          entries.push_back(CSR_ENTRY_T(j, nbrs[x], sims[x]));
+          kept++;
+        }
+      }
+    }
+    itemNeighbours = CSRMtx(lists.rows, lists.cols, entries);
+    cout << " SessionModel " << itemIndex.size() << " items "
+      << itemNeighbours.nnz() << " neighbours\n";
+  }
+
+  void loadItemIndex(const char *filePath)
+  {
+    FILE *fp = fopen(filePath, "rb");
+    if(!fp)
+      throw(" SessionModel::loadItemIndex file not found");
+    long long n = 0;
+    size_t rsz = fread(&n, sizeof(n), 1, fp);
+    itemIndex = INT_T_VEC(n);
+    if(n)
+      rsz += fread(&itemIndex[0], sizeof(INT_T), n, fp);
+    fclose(fp);
+    if(rsz != n + 1)
+      throw(" SessionModel::loadItemIndex if(rsz != (n +1))");
+
+    INT_T maxId = n ? *max_element(itemIndex.begin(), itemIndex.end()) : -1;
+    itemReverseIndex = INT_T_VEC(maxId + 1, -1);
+    for(INT_T i = 0; i < n; i++)
+      itemReverseIndex[itemIndex[i]] = i;
+  }
+
+  INT_T codedItem(INT_T realId) const
+  {
+    return (realId >= 0 && realId < itemReverseIndex.size()) ? itemReverseIndex[realId] : -1;
+  }
+
+  INT_T numItems() const { return itemIndex.size(); }
+};
+
+typedef struct SESSION_RECO_T {
+  INT_T itemId; // real id
+  FLT_T score;
+  SESSION_RECO_T(INT_T iid, FLT_T s) : itemId(iid), score(s) { }
+} SESSION_RECO_T;
+
+class SessionRecommender {
+  const SessionModel &model;
+  INT_T maxN;
+  vector<FLT_T> score;   // per coded item, all zero between calls
+  INT_T_VEC inSession;   // per coded item, == callStamp if in this session
+  INT_T callStamp;
+  INT_T_VEC touched;
+  TopNSelector topN;
+  vector<SESSION_RECO_T> recoList;
+
+public:
+  // maxN is the largest N recommend() will be asked for
+  SessionRecommender(const SessionModel &_model, INT_T _maxN) :
+    model(_model), maxN(_maxN), score(_model.numItems(), 0),
+    inSession(_model.numItems(), 0), callStamp(0), topN(_maxN)
+  {
+    touched.reserve(model.numItems());
+    recoList.reserve(maxN);
+  }
+
+  // Top N (at most maxN) items for the session, best first, real ids.
+  // weights (e.g. recency or rating of each session item) default to 1,
+  // unknown item ids are ignored. The result stays valid until the next
+  // call on this recommender.
+  const vector<SESSION_RECO_T> & recommend(const INT_T *sessionItems,
+    INT_T numSessionItems, INT_T N, const FLT_T *weights = 0)
+  {
+    if(++callStamp == INT_T_MAX()) {
+      fill(inSession.begin(), inSession.end(), 0);
+      callStamp = 1;
+    }
+    for(INT_T s = 0; s < numSessionItems; s++) {
+      INT_T j = model.codedItem(sessionItems[s]);
+      if(j >= 0)
+        inSession[j] = callStamp;
+    }
+
+    touched.clear();
+    for(INT_T s = 0; s < numSessionItems; s++) {
+      INT_T j = model.codedItem(sessionItems[s]);
+      if(j < 0)
+        continue;
+      FLT_T w = weights ? weights[s] : 1;
+      INT_T n = model.itemNeighbours.rowSize(j);
+      const INT_T *nbrs = model.itemNeighbours.rowCols(j);
+      const FLT_T *sims = model.itemNeighbours.rowVals(j);
+      for(INT_T x = 0; x < n; x++) {
+        INT_T i = nbrs[x];
+        if(inSession[i] == callStamp)
+          continue;
+        if(score[i] == 0)
+          touched.push_back(i);
+        score[i] += w * sims[x];
+      }
+    }
+
+    topN.reset(min(N, maxN));
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T i = touched[x];
+      if(score[i] > 0)
+        topN.offer(i, score[i]);
+      score[i] = 0;
+    }
+    topN.getSorted(recoList);
+    for(INT_T x = 0; x < recoList.size(); x++)
+      recoList[x].itemId = model.itemIndex[recoList[x].itemId];
+    return recoList;
+  }
+};
+
+#endif // SESSION_RECOMMENDER_HPP
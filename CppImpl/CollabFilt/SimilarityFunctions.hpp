@@ -88,4 +88,61 @@ class AdjustedCosine { };
 
       return cosine_coeff;
     }
+
+    // int8 rows, see QuantizedItemRatings
+    template<>
+    FLT_T NeighbourHoodRecommender<AdjustedCosine>::
+    getSimilarityQ8(INT_T i1, INT_T i2)
+    {
+      Q8_DOT_T d = q8Ratings->dot(i1, i2);
+      if(d.count <= 1)
+        return 0;
+      return d.numerator / (sqrt((double) d.sq1) * sqrt((double) d.sq2));
+    }
+
+    template<>
+    FLT_T NeighbourHoodRecommender<RawCosine>::
+    getSimilarityQ8(INT_T i1, INT_T i2)
+    {
+      Q8_DOT_T d = q8Ratings->dot(i1, i2);
+      if(d.count == 0)
+        return 0;
+      return d.numerator / sqrt((double) d.sq1 * d.sq2);
+    }
+
+    // mean centered sums over the co-raters of a pair, see PairStats
+    inline void getCenteredSums(const PairStats &ps, double m1, double m2,
+      double &numerator, double &sq1, double &sq2)
+    {
+      double n = ps.count;
+      numerator = ps.sumProd - m2 * ps.sum1 - m1 * ps.sum2 + n * m1 * m2;
+      sq1 = ps.sumSq1 - 2 * m1 * ps.sum1 + n * m1 * m1;
+      sq2 = ps.sumSq2 - 2 * m2 * ps.sum2 + n * m2 * m2;
+      sq1 = max(sq1, 0.0); // rounding can go slightly below zero
+      sq2 = max(sq2, 0.0);
+    }
+
+    template<>
+    FLT_T NeighbourHoodRecommender<AdjustedCosine>::
+    getSimilarityFromStats(const PairStats &ps, double mean1, double mean2)
+    {
+      if(ps.count <= 1)
+        return 0;
+
+      double numerator, sq1, sq2;
+      getCenteredSums(ps, mean1, mean2, numerator, sq1, sq2);
+      return numerator / (sqrt(sq1) * sqrt(sq2));
+    }
+
+    template<>
+    FLT_T NeighbourHoodRecommender<RawCosine>::
+    getSimilarityFromStats(const PairStats &ps, double mean1, double mean2)
+    {
+      if(ps.count == 0)
+        return 0;
+
+      double numerator, sq1, sq2;
+      getCenteredSums(ps, mean1, mean2, numerator, sq1, sq2);
+      return numerator / sqrt(sq1 * sq2);
+    }
 #endif
@@ -0,0 +1,332 @@
+#ifndef SIMILARITY_STATS_HPP
+#define SIMILARITY_STATS_HPP
+
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+#include "../utils/Utils.hpp"
+
+// Sufficient statistics over the users that rated both items of a pair.
+// Sums are kept over raw integer ratings so that adding or changing a
+// rating updates them exactly. Mean centering is applied only when the
+// similarity is computed, using the item means current at that time:
+//   sum((r1-m1)*(r2-m2)) = sumProd - m2*sum1 - m1*sum2 + count*m1*m2
+// so item mean drift never leaves stale values behind.
+typedef struct PairStats {
+  INT_T count; // co-raters
+  INT_T sum1, sum2;
+  INT_T sumSq1, sumSq2;
+  INT_T sumProd;
+
+  PairStats() : count(0), sum1(0), sum2(0), sumSq1(0), sumSq2(0), sumProd(0) { }
+
+  void add(INT_T r1, INT_T r2, INT_T sign = 1) {
+    count += sign;
+    sum1 += sign * r1;
+    sum2 += sign * r2;
+    sumSq1 += sign * r1 * r1;
+    sumSq2 += sign * r2 * r2;
+    sumProd += sign * r1 * r2;
+  }
+} PairStats;
+
+typedef struct ItemRating_T {
+  INT_T iid;
+  INT_T rtng;
+  ItemRating_T() : iid(0), rtng(0) { }
+  ItemRating_T(INT_T i, INT_T r) : iid(i), rtng(r) { }
+} ItemRating_T;
+
+typedef unordered_map<INT_T, PairStats> PAIR_STATS_ROW;
+
+// Pair statistics for every pair of items with at least one co-rater,
+// plus the per user ratings needed to find the pairs a new rating touches.
+// rows[i1] holds the pairs (i1, i2) with i1 < i2.
+class PairStatsStore {
+  vector<PAIR_STATS_ROW> rows;
+  vector<INT_T> itemRatingCount;
+  vector<long long> itemRatingSum;
+  vector< vector<ItemRating_T> > usrRatings; // coded user -> rated items
+  vector< vector<INT_T> > itemUsrs; // item -> raters, see indexItemRaters()
+
+  void updatePair(INT_T i, INT_T ri, INT_T j, INT_T rj, INT_T sign)
+  {
+    if(i == j)
+      return;
+    PAIR_STATS_ROW &row = rows[min(i, j)];
+    INT_T col = max(i, j);
+    PairStats &ps = row[col];
+    if(i < j)
+      ps.add(ri, rj, sign);
+    else
+      ps.add(rj, ri, sign);
+    if(ps.count == 0)
+      row.erase(col);
+  }
+
+  void buildRows(vector< vector<ItemRating_T> > &itemUsrs,
+    std::atomic<INT_T> &nextRow)
+  {
+    INT_T numItems = rows.size();
+    for(INT_T i1 = nextRow++; i1 < numItems; i1 = nextRow++) {
+      PAIR_STATS_ROW &row = rows[i1];
+      vector<ItemRating_T> &raters = itemUsrs[i1]; // iid holds the user here
+      for(INT_T x = 0; x < raters.size(); x++) {
+        INT_T r1 = raters[x].rtng;
+        vector<ItemRating_T> &ur = usrRatings[raters[x].iid];
+        for(INT_T y = 0; y < ur.size(); y++) {
+          if(ur[y].iid > i1)
+            row[ur[y].iid].add(r1, ur[y].rtng);
+        }
+      }
+    }
+  }
+
+  template<typename T>
+  void writeValue(FILE *fp, const T &v)
+  {
+    if(fwrite(&v, sizeof(T), 1, fp) != 1)
+      throw("PairStatsStore::writeValue fwrite failed");
+  }
+
+  template<typename T>
+  void readValue(FILE *fp, T &v)
+  {
+    if(fread(&v, sizeof(T), 1, fp) != 1)
+      throw("PairStatsStore::readValue fread failed");
+  }
+
+public:
+  PairStatsStore(INT_T numItems, INT_T numUsrs) :
+    rows(numItems), itemRatingCount(numItems, 0), itemRatingSum(numItems, 0),
+    usrRatings(numUsrs)
+  {
+  }
+
+  PairStatsStore(const char *filePath)
+  {
+    readFromFileSystem(filePath);
+  }
+
+  INT_T getNumItems() { return rows.size(); }
+  INT_T getNumUsrs() { return usrRatings.size(); }
+
+  // Used while loading the training set, before build()
+  void setRating(INT_T usr, INT_T itm, INT_T rtng)
+  {
+    usrRatings[usr].push_back(ItemRating_T(itm, rtng));
+    itemRatingCount[itm]++;
+    itemRatingSum[itm] += rtng;
+  }
+
+  void build(INT_T threadCount)
+  {
+  START_TIME_STAMP("PairStatsStore::build");
+    vector< vector<ItemRating_T> > itemUsrs(rows.size());
+    for(INT_T u = 0; u < usrRatings.size(); u++) {
+      for(INT_T x = 0; x < usrRatings[u].size(); x++) {
+        ItemRating_T &ir = usrRatings[u][x];
+        itemUsrs[ir.iid].push_back(ItemRating_T(u, ir.rtng));
+      }
+    }
+
+    std::atomic<INT_T> nextRow(0);
+    vector<thread> threadList;
+    for(INT_T i=0; i<threadCount; i++) {
+      threadList.push_back(thread(&PairStatsStore::buildRows, this,
+        std::ref(itemUsrs), std::ref(nextRow)));
+    }
+    for(INT_T i=0; i<threadList.size(); i++) {
+      threadList[i].join();
+    }
+  END_TIME_STAMP;
+  }
+
+  // Adds a new rating or replaces an existing one, only the pairs
+  // (itm, j) for items j rated by usr are touched. Returns false if
+  // itm is outside the items known to the store.
+  bool addRating(INT_T usr, INT_T itm, INT_T rtng)
+  {
+    if(itm < 0 || itm >= rows.size())
+      return false;
+    if(usr >= usrRatings.size())
+      usrRatings.resize(usr + 1);
+
+    vector<ItemRating_T> &ur = usrRatings[usr];
+    INT_T existing = -1;
+    for(INT_T x = 0; x < ur.size(); x++) {
+      if(ur[x].iid == itm) {
+        existing = x;
+        break;
+      }
+    }
+
+    if(existing >= 0) {
+      INT_T oldRtng = ur[existing].rtng;
+      for(INT_T x = 0; x < ur.size(); x++) {
+        updatePair(itm, oldRtng, ur[x].iid, ur[x].rtng, -1);
+        updatePair(itm, rtng, ur[x].iid, ur[x].rtng, 1);
+      }
+      ur[existing].rtng = rtng;
+      itemRatingSum[itm] += rtng - oldRtng;
+      return true;
+    }
+
+    for(INT_T x = 0; x < ur.size(); x++) {
+      updatePair(itm, rtng, ur[x].iid, ur[x].rtng, 1);
+    }
+    ur.push_back(ItemRating_T(itm, rtng));
+    itemRatingCount[itm]++;
+    itemRatingSum[itm] += rtng;
+    return true;
+  }
+
+  double getItemMean(INT_T itm)
+  {
+    INT_T n = itemRatingCount[itm];
+    return n ? (double) itemRatingSum[itm] / n : 0;
+  }
+
+  // pairs of i1 with items greater than i1
+  PAIR_STATS_ROW& getRow(INT_T i1) { return rows[i1]; }
+
+  // the raters of every item, for getPartnersBelow(), again after
+  // addRating() calls
+  void indexItemRaters()
+  {
+    itemUsrs = vector< vector<INT_T> >(rows.size());
+    for(INT_T u = 0; u < usrRatings.size(); u++) {
+      for(INT_T x = 0; x < usrRatings[u].size(); x++)
+        itemUsrs[usrRatings[u][x].iid].push_back(u);
+    }
+  }
+
+  // Items j < itm sharing a rater with itm, so exactly the j whose rows
+  // hold a pair (j, itm). Found by walking itm's raters' items, the
+  // buildRows() work of one item, or for popular items where that walk is
+  // longer than itm by probing rows[j] of every j < itm. seen is all zero
+  // over the items before and after the call.
+  void getPartnersBelow(INT_T itm, vector<char> &seen, vector<INT_T> &out)
+  {
+    out.clear();
+    vector<INT_T> &raters = itemUsrs[itm];
+    long long walk = 0;
+    for(INT_T x = 0; x < raters.size(); x++)
+      walk += usrRatings[raters[x]].size();
+    if(walk > itm) {
+      for(INT_T j = 0; j < itm; j++) {
+        if(rows[j].count(itm))
+          out.push_back(j);
+      }
+      return;
+    }
+    for(INT_T x = 0; x < raters.size(); x++) {
+      vector<ItemRating_T> &ur = usrRatings[raters[x]];
+      for(INT_T y = 0; y < ur.size(); y++) {
+        INT_T j = ur[y].iid;
+        if(j < itm && !seen[j]) {
+          seen[j] = 1;
+          out.push_back(j);
+        }
+      }
+    }
+    for(INT_T x = 0; x < out.size(); x++)
+      seen[out[x]] = 0;
+  }
+
+  // returns 0 if the items have no co-raters
+  const PairStats* getPairStats(INT_T i1, INT_T i2)
+  {
+    if(i1 > i2)
+      swap(i1, i2);
+    PAIR_STATS_ROW &row = rows[i1];
+    auto it = row.find(i2);
+    return it == row.end() ? 0 : &it->second;
+  }
+
+  long long getNumPairs()
+  {
+    long long n = 0;
+    for(INT_T i = 0; i < rows.size(); i++)
+      n += rows[i].size();
+    return n;
+  }
+
+  void writeToFileSystem(const char *filePath)
+  {
+    FILE *fp = fopen(filePath, "wb");
+    if(!fp)
+      throw("PairStatsStore::writeToFileSystem if(!fp)");
+
+    INT_T numItems = rows.size();
+    INT_T numUsrs = usrRatings.size();
+    writeValue(fp, numItems);
+    writeValue(fp, numUsrs);
+    for(INT_T i = 0; i < numItems; i++) {
+      writeValue(fp, itemRatingCount[i]);
+      writeValue(fp, itemRatingSum[i]);
+    }
+    for(INT_T u = 0; u < numUsrs; u++) {
+      INT_T n = usrRatings[u].size();
+      writeValue(fp, n);
+      if(n && fwrite(&usrRatings[u][0], sizeof(ItemRating_T), n, fp) != n)
+        throw("PairStatsStore::writeToFileSystem usrRatings");
+    }
+    for(INT_T i = 0; i < numItems; i++) {
+      INT_T n = rows[i].size();
+      writeValue(fp, n);
+      for(auto it = rows[i].begin(); it != rows[i].end(); ++it) {
+        writeValue(fp, it->first);
+        writeValue(fp, it->second);
+      }
+    }
+    fclose(fp);
+  }
+
+  void readFromFileSystem(const char *filePath)
+  {
+    FILE *fp = fopen(filePath, "rb");
+    if(!fp)
+      throw("PairStatsStore::readFromFileSystem if(!fp)");
+
+    INT_T numItems = 0, numUsrs = 0;
+    readValue(fp, numItems);
+    readValue(fp, numUsrs);
+    if(numItems <= 0 || numUsrs < 0)
+      throw("PairStatsStore::readFromFileSystem bad header");
+
+    rows = vector<PAIR_STATS_ROW>(numItems);
+    itemRatingCount = vector<INT_T>(numItems);
+    itemRatingSum = vector<long long>(numItems);
+    usrRatings = vector< vector<ItemRating_T> >(numUsrs);
+
+    for(INT_T i = 0; i < numItems; i++) {
+      readValue(fp, itemRatingCount[i]);
+      readValue(fp, itemRatingSum[i]);
+    }
+    for(INT_T u = 0; u < numUsrs; u++) {
+      INT_T n = 0;
+      readValue(fp, n);
+      usrRatings[u] = vector<ItemRating_T>(n);
+      if(n && fread(&usrRatings[u][0], sizeof(ItemRating_T), n, fp) != n)
+        throw("PairStatsStore::readFromFileSystem usrRatings");
+    }
+    for(INT_T i = 0; i < numItems; i++) {
+      INT_T n = 0;
+      readValue(fp, n);
+      rows[i].reserve(n);
+      for(INT_T x = 0; x < n; x++) {
+        INT_T col;
+        PairStats ps;
+        readValue(fp, col);
+        readValue(fp, ps);
+        rows[i][col] = ps;
+      }
+    }
+    fclose(fp);
+  }
+};
+
+#endif // SIMILARITY_STATS_HPP
@@ -0,0 +1,203 @@
+#ifndef USER_USER_LEARNER_HPP
+#define USER_USER_LEARNER_HPP
+
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <queue>
+
+#include "../utils/Utils.hpp"
+#include "../utils/CSRMtx.hpp"
+
+typedef struct NEIGHBOUR_T {
+  INT_T id;
+  FLT_T similarity;
+  NEIGHBOUR_T(INT_T i, FLT_T s) : id(i), similarity(s) { }
+  // min heap on similarity with std::priority_queue
+  bool operator<(const NEIGHBOUR_T& another) const { return similarity > another.similarity; }
+} NEIGHBOUR_T;
+
+// Builds the top K most similar users of every user without comparing
+// all user pairs. Candidates of a user are only the users found in the
+// inverted lists (raters) of the items the user rated, the dot product of
+// mean centered ratings of each candidate is then taken over the two
+// users' full rows. Items with more than maxItemRaters raters are left out
+// of the candidate search, popular items add most of the work and little
+// discrimination; they still count in every similarity.
+// Users are processed in blocks pulled by each thread, each thread keeps
+// one dense accumulator over all users that is reused for every user.
+class UserNeighbourhoodBuilder {
+  const CSRMtx &usrRatings; // user x item
+  INT_T K;
+  INT_T maxItemRaters;
+  INT_T minCommonItems;
+  INT_T threadCount;
+
+  vector<FLT_T> usrMean;
+  vector<FLT_T> usrNorm; // norm of mean centered ratings
+  CSRMtx itmUsrs; // item x user, the candidate lists
+  vector< vector<NEIGHBOUR_T> > neighbours;
+  std::atomic<INT_T> nextBlock;
+  std::atomic<long long> candidatesSeen;
+
+  static const INT_T USERS_PER_BLOCK = 1024;
+
+  void centerRatings()
+  {
+    INT_T numUsrs = usrRatings.rows;
+    usrMean = vector<FLT_T>(numUsrs, 0);
+    usrNorm = vector<FLT_T>(numUsrs, 0);
+
+    for(INT_T u = 0; u < numUsrs; u++) {
+      INT_T n = usrRatings.rowSize(u);
+      const FLT_T *rv = usrRatings.rowVals(u);
+      FLT_T sum = 0;
+      for(INT_T x = 0; x < n; x++)
+        sum += rv[x];
+      usrMean[u] = n ? sum / n : 0;
+
+      FLT_T sq = 0;
+      for(INT_T x = 0; x < n; x++) {
+        FLT_T c = rv[x] - usrMean[u];
+        sq += c * c;
+      }
+      usrNorm[u] = sqrt(sq);
+    }
+    usrRatings.transpose(itmUsrs);
+  }
+
+  // dot product of the mean centered ratings of u and v over the items
+  // both rated, their rows are sorted by item so one merge finds them all
+  FLT_T overlap(INT_T u, INT_T v, INT_T &common) const
+  {
+    const INT_T *iu = usrRatings.rowCols(u), *iv = usrRatings.rowCols(v);
+    const FLT_T *ru = usrRatings.rowVals(u), *rv = usrRatings.rowVals(v);
+    INT_T nu = usrRatings.rowSize(u), nv = usrRatings.rowSize(v);
+    FLT_T dot = 0;
+    common = 0;
+    for(INT_T x = 0, y = 0; x < nu && y < nv; ) {
+      if(iu[x] < iv[y])
+        x++;
+      else if(iu[x] > iv[y])
+        y++;
+      else {
+        dot += (ru[x] - usrMean[u]) * (rv[y] - usrMean[v]);
+        common++;
+        x++;
+        y++;
+      }
+    }
+    return dot;
+  }
+
+  // The capped inverted lists only pick the candidates, the similarity of
+  // each is computed over all items both users rated so the cap does not
+  // change the scores, only which users get scored
+  void findNeighbours(INT_T u, vector<FLT_T> &dot, vector<INT_T> &common,
+    vector<INT_T> &touched)
+  {
+    const INT_T *items = usrRatings.rowCols(u);
+    INT_T n = usrRatings.rowSize(u);
+
+    touched.clear();
+    for(INT_T x = 0; x < n; x++) {
+      INT_T itm = items[x];
+      INT_T raters = itmUsrs.rowSize(itm);
+      if(maxItemRaters > 0 && raters > maxItemRaters)
+        continue;
+      const INT_T *vs = itmUsrs.rowCols(itm);
+      for(INT_T y = 0; y < raters; y++) {
+        INT_T v = vs[y];
+        if(v == u || common[v])
+          continue;
+        touched.push_back(v);
+        common[v] = 1;
+      }
+    }
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T v = touched[x];
+      dot[v] = overlap(u, v, common[v]);
+    }
+
+    priority_queue<NEIGHBOUR_T> topK;
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T v = touched[x];
+      FLT_T denominator = usrNorm[u] * usrNorm[v];
+      FLT_T sim = denominator > 0 ? dot[v] / denominator : 0;
+      if(common[v] >= minCommonItems && sim > 0) {
+        if(topK.size() < K) {
+          topK.push(NEIGHBOUR_T(v, sim));
+        } else if(sim > topK.top().similarity) {
+          topK.pop();
+          topK.push(NEIGHBOUR_T(v, sim));
+        }
+      }
+      dot[v] = 0;
+      common[v] = 0;
+    }
+    candidatesSeen += touched.size();
+
+    vector<NEIGHBOUR_T> &nu = neighbours[u];
+    while(!topK.empty()) {
+      nu.push_back(topK.top());
+      topK.pop();
+    }
+  }
+
+  void neighboursThread(INT_T threadIndex)
+  {
+    INT_T numUsrs = usrRatings.rows;
+    vector<FLT_T> dot(numUsrs, 0);
+    vector<INT_T> common(numUsrs, 0);
+    vector<INT_T> touched;
+
+    for(INT_T b = nextBlock++; (long long) b * USERS_PER_BLOCK < numUsrs; b = nextBlock++) {
+      INT_T first = b * USERS_PER_BLOCK;
+      INT_T last = min(numUsrs, first + USERS_PER_BLOCK);
+      for(INT_T u = first; u < last; u++) {
+        findNeighbours(u, dot, common, touched);
+      }
+    }
+  }
+
+public:
+  UserNeighbourhoodBuilder(const CSRMtx &_usrRatings, INT_T _K,
+    INT_T _maxItemRaters, INT_T _threadCount, INT_T _minCommonItems = 2) :
+    usrRatings(_usrRatings), K(_K), maxItemRaters(_maxItemRaters),
+    minCommonItems(_minCommonItems), threadCount(_threadCount),
+    nextBlock(0), candidatesSeen(0)
+  {
+  }
+
+  // rows are users, each row holds up to K (neighbour, similarity) pairs
+  void build(CSRMtx &neighbourMtx)
+  {
+  START_TIME_STAMP("UserNeighbourhoodBuilder::build");
+    centerRatings();
+    INT_T numUsrs = usrRatings.rows;
+    neighbours = vector< vector<NEIGHBOUR_T> >(numUsrs);
+
+    vector<thread> threadList;
+    for(INT_T i=0; i<threadCount; i++) {
+      threadList.push_back(thread(&UserNeighbourhoodBuilder::neighboursThread, this, i));
+    }
+    for(INT_T i=0; i<threadList.size(); i++) {
+      threadList[i].join();
+    }
+
+    vector<CSR_ENTRY_T> entries;
+    for(INT_T u = 0; u < numUsrs; u++) {
+      for(INT_T x = 0; x < neighbours[u].size(); x++) {
+        entries.push_back(CSR_ENTRY_T(u, neighbours[u][x].id, neighbours[u][x].similarity));
+      }
+      vector<NEIGHBOUR_T>().swap(neighbours[u]);
+    }
+    neighbourMtx = CSRMtx(numUsrs, numUsrs, entries);
+
+    cout << " users " << numUsrs << " candidate pairs scored " << candidatesSeen
+      << " neighbours kept " << neighbourMtx.nnz() << "\n";
+  END_TIME_STAMP;
+  }
+};
+
+#endif // USER_USER_LEARNER_HPP
@@ -0,0 +1,294 @@
+#ifndef USERUSER_PREDICTOR_HPP
+#define USERUSER_PREDICTOR_HPP
+
+#include <thread>
+#include <sstream>
+
+#include "../utils/Utils.hpp"
+#include "../utils/CSRMtx.hpp"
+#include "../utils/TopN.hpp"
+#include "../utils/RecoWriter.hpp"
+#include "ItemItemPredictor.hpp"
+
+// Predicts from the neighbour lists written by the learner for
+// --recommendation-type user-user
+//   r(u,i) = mean(u) + sum(s(u,v) * (r(v,i) - mean(v))) / sum(|s(u,v)|)
+// over the neighbours v of u that rated i.
+class UserUserPredictor {
+  ItemItemPredictorParams params;
+  CSRMtx usrRatings; // user x item
+  CSRMtx neighbours; // user x user similarity
+  vector<FLT_T> usrMean;
+  INT_T_VEC itemIndex;
+  INT_T_VEC userIndex;
+  INT_T_VEC itemReverseIndex;
+  INT_T_VEC userReverseIndex;
+  vector<TEST_RATING_T> testSet; // held out, left out of usrRatings
+
+  template<typename T>
+  void loadVector(const char *filePath, vector<T>& vT)
+  {
+    FILE * fp = fopen(filePath, "r");
+    if(!fp)
+      throw(" loadVector file not found");
+    long long vSz = 0;
+    size_t rsz = fread(&vSz, sizeof(vSz), 1, fp);
+    for(long long i=0; i < vSz; i++) {
+      T v;
+      rsz += fread(&v, sizeof(v), 1, fp);
+      vT.push_back(v);
+    }
+    fclose(fp);
+    if(rsz != (vSz +1)) {
+      vT.clear();
+      throw(" loadVector if(rsz != (vSz +1))");
+    }
+  }
+
+  void createReverseIndex(INT_T_VEC &vi, INT_T_VEC &revi)
+  {
+    revi = INT_T_VEC(*max_element(vi.begin(), vi.end()) + 1, -1);
+    for(INT_T i=0; i<vi.size(); i++) {
+      revi[vi[i]] = i;
+    }
+  }
+
+  INT_T lookup(INT_T_VEC &revi, INT_T id)
+  {
+    return (id >= 0 && id < revi.size()) ? revi[id] : -1;
+  }
+
+  bool isHeldOut(INT_T uid, INT_T iid)
+  {
+    return testSet.size() &&
+      binary_search(testSet.begin(), testSet.end(), TEST_RATING_T(uid, iid, 0));
+  }
+
+  void loadTestSet()
+  {
+    long long unknown = loadTestSetRatings(params.test_set_file_path.c_str(),
+      [this](INT_T u) { return lookup(userReverseIndex, u); },
+      [this](INT_T i) { return lookup(itemReverseIndex, i); },
+      testSet);
+    cout << " test set " << testSet.size() << " ratings, " << unknown
+      << " with unknown user or item ids dropped\n";
+  }
+
+  void readInputCSV()
+  {
+    INT_T userid, itemid, rating, rc = 0, heldOut = 0;
+    FILE * csvFile = fopen (params.csv_input_file_path.c_str(), "r");
+    if(!csvFile) {
+      cout << " ERROR2: Unable to open input file check \"" << params.csv_input_file_path
+           << "\" check --input-csv-file-path arg"<< "\n";
+      throw(" Unable to open ratings csv input file");
+    }
+
+    vector<CSR_ENTRY_T> entries;
+    while(true) {
+      int r = fscanf(csvFile,"%d %d %d",&userid, &itemid, &rating);
+      if(r<0) {
+        break;
+      }
+      INT_T uid = lookup(userReverseIndex, userid);
+      INT_T iid = lookup(itemReverseIndex, itemid);
+      if(uid < 0 || iid < 0)
+        continue;
+      if(isHeldOut(uid, iid)) {
+        heldOut++;
+        continue;
+      }
+      entries.push_back(CSR_ENTRY_T(uid, iid, rating));
+      rc++;
+    }
+    fclose(csvFile);
+    cout << " total entries mapped " << rc << " held out (in the test set) "
+      << heldOut << "\n";
+
+    usrRatings = CSRMtx(userIndex.size(), itemIndex.size(), entries);
+    usrMean = vector<FLT_T>(userIndex.size(), 0);
+    for(INT_T u = 0; u < usrRatings.rows; u++) {
+      INT_T n = usrRatings.rowSize(u);
+      const FLT_T *rv = usrRatings.rowVals(u);
+      FLT_T sum = 0;
+      for(INT_T x = 0; x < n; x++)
+        sum += rv[x];
+      usrMean[u] = n ? sum / n : 0;
+    }
+  }
+
+  // scatters the neighbours' ratings into per item sums,
+  // touched collects the items that received a contribution
+  void scatterNeighbourRatings(INT_T usr, vector<FLT_T> &num,
+    vector<FLT_T> &den, INT_T_VEC &touched)
+  {
+    INT_T n = neighbours.rowSize(usr);
+    const INT_T *vs = neighbours.rowCols(usr);
+    const FLT_T *sims = neighbours.rowVals(usr);
+
+    for(INT_T x = 0; x < n; x++) {
+      INT_T v = vs[x];
+      FLT_T s = sims[x];
+      INT_T m = usrRatings.rowSize(v);
+      const INT_T *items = usrRatings.rowCols(v);
+      const FLT_T *ratings = usrRatings.rowVals(v);
+      for(INT_T y = 0; y < m; y++) {
+        INT_T itm = items[y];
+        if(den[itm] == 0)
+          touched.push_back(itm);
+        num[itm] += s * (ratings[y] - usrMean[v]);
+        den[itm] += fabs(s);
+      }
+    }
+  }
+
+  void recommend(INT_T usr, vector<FLT_T> &num, vector<FLT_T> &den,
+    INT_T_VEC &touched, TopNSelector &topN, vector<RECO_RANK_T> &recoList)
+  {
+    touched.clear();
+    topN.reset();
+    scatterNeighbourRatings(usr, num, den, touched);
+
+    for(INT_T x = 0; x < touched.size(); x++) {
+      INT_T itm = touched[x];
+      if(usrRatings.find(usr, itm) < 0)
+        topN.offer(itm, usrMean[usr] + num[itm] / den[itm]);
+      num[itm] = 0;
+      den[itm] = 0;
+    }
+    topN.getSorted(recoList);
+  }
+
+  // users [userFirst, userLast)
+  void generateRecommendationsForUsrRange(INT_T userFirst, INT_T userLast,
+    RecoWriter &writer, INT_T shard, RECO_SCRATCH_T &sc)
+  {
+    for(INT_T usr = userFirst; usr < userLast; usr++) {
+      recommend(usr, sc.num, sc.den, sc.touched, sc.topN, sc.recoList);
+      for(INT_T i = 0; i < sc.recoList.size(); i++) {
+        sc.recoList[i].itemId = itemIndex[sc.recoList[i].itemId];
+      }
+      writer.write(shard, userIndex[usr], usr, sc.recoList);
+    }
+  }
+
+public:
+  UserUserPredictor(ItemItemPredictorParams &_params): params(_params)
+  {
+  }
+
+  void prepareForPrediction()
+  {
+    cout << " UserUserPredictor::prepareForPrediction started\n";
+    loadVector<INT_T>(params.item_index_table_path.c_str(), itemIndex);
+    loadVector<INT_T>(params.user_index_table_path.c_str(), userIndex);
+    createReverseIndex(itemIndex, itemReverseIndex);
+    createReverseIndex(userIndex, userReverseIndex);
+    neighbours.readFromFileSystem(params.user_neighbours_file_path.c_str());
+    if(neighbours.rows != userIndex.size())
+      throw(" UserUserPredictor::prepareForPrediction neighbours and user index do not match");
+    if(params.test_set_file_path.size())
+      loadTestSet();
+    readInputCSV();
+  }
+
+  // use coded ids, returns NAN when no neighbour rated the item
+  FLT_T predict(INT_T usr, INT_T itm)
+  {
+    INT_T n = neighbours.rowSize(usr);
+    const INT_T *vs = neighbours.rowCols(usr);
+    const FLT_T *sims = neighbours.rowVals(usr);
+    FLT_T numerator = 0, denominator = 0;
+
+    for(INT_T x = 0; x < n; x++) {
+      FLT_T r = usrRatings.get(vs[x], itm, NAN);
+      if(isnan(r))
+        continue;
+      numerator += sims[x] * (r - usrMean[vs[x]]);
+      denominator += fabs(sims[x]);
+    }
+    if(denominator == 0)
+      return NAN;
+    return usrMean[usr] + numerator / denominator;
+  }
+
+  // RMSE / MAE over the test set, ratings no neighbour rated the item of
+  // are skipped
+  EVAL_RESULT_T evaluateTestSet()
+  {
+    START_TIME_STAMP("UserUserPredictor::evaluateTestSet");
+    EVAL_RESULT_T res = evaluateRatings(testSet,
+      [this](INT_T u, INT_T i) { return predict(u, i); },
+      poolThreadCount(params.max_threads_count));
+    res.print("test set");
+    END_TIME_STAMP;
+    return res;
+  }
+
+  // the ranking metrics of ItemItemPredictor::evaluateRanking over the
+  // user-user top N lists
+  vector<RANK_RESULT_T> evaluateRanking()
+  {
+    START_TIME_STAMP("UserUserPredictor::evaluateRanking");
+    RELEVANT_ITEMS_T rel;
+    groupRelevantItems(testSet, params.relevant_rating_threshold, rel);
+    sampleRelevantUsers(rel, params.ranking_sample_users);
+
+    INT_T threadCount = poolThreadCount(params.max_threads_count);
+    vector<RECO_SCRATCH_T> scratch(threadCount);
+
+    vector<RANK_RESULT_T> results = ::evaluateRanking(rel,
+      parseCommaList<INT_T>(params.ranking_cutoffs), itemIndex.size(),
+      [&](INT_T usr, INT_T maxN, INT_T t, INT_T_VEC &out) {
+        RECO_SCRATCH_T &sc = scratch[t];
+        sc.prepare(itemIndex.size(), maxN);
+        recommend(usr, sc.num, sc.den, sc.touched, sc.topN, sc.recoList);
+        for(INT_T i = 0; i < sc.recoList.size(); i++)
+          out.push_back(sc.recoList[i].itemId);
+      }, threadCount);
+
+    for(INT_T n = 0; n < results.size(); n++)
+      results[n].print("user-user");
+    END_TIME_STAMP;
+    return results;
+  }
+
+  // returns coded indexes for items
+  INT_T_VEC recommendProducts(INT_T usr, INT_T numItems)
+  {
+    vector<FLT_T> num(itemIndex.size(), 0), den(itemIndex.size(), 0);
+    INT_T_VEC touched, vItems;
+    TopNSelector topN(numItems);
+    vector<RECO_RANK_T> recoList;
+    recommend(usr, num, den, touched, topN, recoList);
+    for(INT_T i = 0; i < recoList.size(); i++)
+      vItems.push_back(recoList[i].itemId);
+    return vItems;
+  }
+
+  // same worker pool as ItemItemPredictor, chunks of user_chunk_size users
+  STRING_T generateRecommendationsForAllUsers(STRING_T recoDirPath,
+    INT_T numRecommendationsPerUser, INT_T numThreads)
+  {
+    cout << " UserUserPredictor::generateRecommendationsForAllUsers ..." << endl;
+    INT_T totalUsers = userIndex.size();
+    INT_T threadCount = poolThreadCount(numThreads);
+
+    RecoWriter writer(recoDirPath, params.reco_output_format, threadCount);
+    vector<RECO_SCRATCH_T> scratch(threadCount);
+    BatchTimings timings(threadCount);
+
+    parallelForBatches(totalUsers, max(1, params.user_chunk_size), threadCount,
+      [&](long long first, long long last, INT_T t) {
+        scratch[t].prepare(itemIndex.size(), numRecommendationsPerUser);
+        timings.time(t, first, last, [&](long long f, long long l) {
+          generateRecommendationsForUsrRange(f, l, writer, t, scratch[t]);
+        });
+      });
+    writer.close();
+    timings.report("UserUserPredictor::generateRecommendationsForAllUsers");
+    return STRING_T("ALL USERS");
+  }
+};
+
+#endif // USERUSER_PREDICTOR_HPP
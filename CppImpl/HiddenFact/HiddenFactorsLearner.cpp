@@ -6,7 +6,9 @@
        -I/opt/boost/1_61_0/include/						\
        -L/opt/boost/1_61_0/lib						\
        -lboost_program_options \
-       -O3 -o /tmp/hidden-factor-learner
+       -pthread \
+       -O3 -fno-math-errno -o /tmp/hidden-factor-learner \
+       -std=c++11
 
   Usage:
   export DYLD_LIBRARY_PATH=/opt/boost/1_61_0/lib:$DYLD_LIBRARY_PATH
@@ -14,10 +16,10 @@
   DYLD_LIBRARY_PATH=/opt/boost/1_61_0/lib:$DYLD_LIBRARY_PATH \
   time /tmp/hidden-factor-learner --num-factors 5 \
           --default-rating 2.8485 \
-          --regularization-param-p 0.002 \
-          --regularization-param-q 0.002 \
-          --learning-rate-p 0.000002 \
-          --learning-rate-q 0.000002 \
+          --regularization-param-p 0.000002 \
+          --regularization-param-q 0.000002 \
+          --learning-rate-p 0.002 \
+          --learning-rate-q 0.002 \
           --training-sample-percentage 0.7 \
           --gradient-descent-iteration-count 100 \
           --max-row-dimension 100000000 \
@@ -39,10 +41,10 @@ usrid  itemid rating
   LD_LIBRARY_PATH=/opt/boost/1_61_0/lib:$LD_LIBRARY_PATH \
   time /tmp/hidden-factor-learner --num-factors 2 \
           --default-rating 2.8485 \
-          --regularization-param-p 0.002 \
-          --regularization-param-q 0.002 \
-          --learning-rate-p 0.000002 \
-          --learning-rate-q 0.000002 \
+          --regularization-param-p 0.000002 \
+          --regularization-param-q 0.000002 \
+          --learning-rate-p 0.002 \
+          --learning-rate-q 0.002 \
           --training-sample-percentage 0.7 \
           --gradient-descent-iteration-count 100 \
           --max-row-dimension 100000000 \
@@ -52,6 +54,67 @@ usrid  itemid rating
           --input-csv-file-path /tmp/sf41.csv \
           --p-q-matrix-output-file-path /tmp/
 
+  --training-mode hogwild runs the SGD epochs on --max-threads-count threads
+  (0 for one per hardware thread), each over its own shard of the shuffled
+  training ratings, updating P and Q without locks. Every epoch prints its
+  updates/sec and the validation (T2') RMSE.
+
+  --training-mode stratified splits users and items into --stratified-blocks
+  ranges of about equal rating counts (default 32) and runs an epoch as
+  that many rounds, each round's blocks sharing no user or item range.
+  Threads never write the same P row or Q column, so for a given block
+  count the result is the same for any thread count; with more blocks than
+  threads a thread done early takes the next block of the round instead of
+  idling. --stratified-blocks 0 uses one block per thread, the result then
+  depends on the thread count.
+
+  --epoch-order user-blocked / item-blocked / hilbert (sgd and hogwild modes)
+  groups the shuffled ratings into blocks of --order-block-size (default
+  1024) user ids, item ids, or (user block, item block) cells along a
+  Hilbert curve, and reshuffles only within the blocks every epoch, so
+  consecutive updates reuse cached P / Q rows. The default 'shuffle' keeps
+  the one global shuffle. Each run ends with its RMSE drop per second of
+  training, to compare the orders:
+  for o in shuffle user-blocked item-blocked hilbert; do
+    /tmp/hidden-factor-learner ... --epoch-order $o | grep "order"
+  done
+
+  --training-mode als alternates between solving every user's P row with Q
+  fixed and every item's Q column with P fixed, each row its own k x k
+  normal equations and Cholesky solve, rows spread over the threads. No
+  learning rate, --regularization-param-p / -q are the lambda (as in SGD) of
+  (Y'Y + lambda n I) x = Y'r with n the row's rating count, around 0.05;
+  about 10 sweeps (--gradient-descent-iteration-count 10) are enough:
+  /tmp/hidden-factor-learner --training-mode als --num-factors 10 \
+          --default-rating 0.5 \
+          --regularization-param-p 0.05 --regularization-param-q 0.05 \
+          --gradient-descent-iteration-count 10 \
+          --training-sample-percentage 0.8 \
+          --input-csv-file-path /tmp/sf41.csv \
+          --p-q-matrix-output-file-path /tmp/
+
+  --optimizer adagrad / rmsprop / adam (sgd, hogwild and stratified modes)
+  gives each P and Q entry its own step size, the step
+  (--learning-rate-p / -q, as in plain SGD) divided by the root of
+  the entry's summed (adagrad) or averaged (rmsprop, adam, decay
+  --optimizer-beta2) squared gradients; adam also averages the gradient
+  itself (--optimizer-beta1). Take larger steps than for sgd, about 0.1
+  for adagrad and 0.01 - 0.02 for rmsprop / adam. They get to a given
+  RMSE in far fewer epochs, --target-rmse stops training there and tells
+  after how many epochs and seconds:
+  /tmp/hidden-factor-learner ... --optimizer adagrad \
+          --learning-rate-p 0.1 --learning-rate-q 0.1 \
+          --target-rmse 1.5
+  -fno-math-errno lets the compiler vectorize their square roots.
+
+  Each epoch's model is validated on T2' on its own thread while the next
+  epoch trains (--overlap-validation 1, the default, with more than one
+  hardware thread); training only waits for the copy of P and Q and for a
+  validation still running at its end.
+  The models and RMSEs are those of --overlap-validation 0, which
+  validates between epochs. Each run ends with the seconds training spent
+  waiting on validation.
+
   Install boost:
   ./bootstrap.sh --prefix=/opt/boost/1_61_0
   ./b2 install
@@ -92,6 +155,25 @@ const char * input_csv_str = "Path of input csv file to read rating "
 const char * verbose_mode_level_str = "Show debug info about inner workings ";
 const char * loop_mode_count_str = "Run repeatedly in loop mode for same input ";
 const char * P_Q_matrix_output_file_path_str = "path to store P and Q matrix output";
+const char * relabel_ids_str = "1 to order coded ids by user activity and item "
+  "popularity instead of raw id order ";
+const char * max_threads_count_str = "Number of threads, 0 for one per hardware thread ";
+const char * training_mode_str = "'sgd' (one thread), 'hogwild' (lock free SGD on "
+  "--max-threads-count threads), 'stratified' (threads on independent blocks) "
+  "or 'als' (alternating least squares) ";
+const char * epoch_order_str = "Order of the ratings within an SGD / hogwild epoch "
+  "'shuffle', 'user-blocked', 'item-blocked' or 'hilbert' ";
+const char * order_block_size_str = "User / item ids per block of the blocked epoch orders ";
+const char * overlap_validation_str = "1 to validate each epoch's model on its own "
+  "thread while the next epoch trains, 0 to validate between epochs ";
+const char * optimizer_str = "Step size per parameter: 'sgd' (fixed), 'adagrad', "
+  "'rmsprop' or 'adam', not in als mode ";
+const char * optimizer_beta1_str = "Decay of adam's average step ";
+const char * optimizer_beta2_str = "Decay of rmsprop's and adam's average squared step ";
+const char * optimizer_epsilon_str = "Added to the root of the squared step average ";
+const char * target_rmse_str = "Stop once T2' RMSE is at or below this, 0 for no target ";
+const char * stratified_blocks_str = "Users and items are split into this many blocks "
+  "each in stratified mode (default 32), 0 for one per thread ";
 
 bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
         MatrixFactorizationParams &params)
@@ -115,6 +197,18 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
       ("verbose-mode-level", ProgOpts::value<INT_T>(), verbose_mode_level_str)
       ("loop-mode-count", ProgOpts::value<INT_T>(), loop_mode_count_str)
       ("p-q-matrix-output-file-path", ProgOpts::value<STRING_T>(), P_Q_matrix_output_file_path_str)
+      ("relabel-ids", ProgOpts::value<INT_T>(), relabel_ids_str)
+      ("max-threads-count", ProgOpts::value<INT_T>(), max_threads_count_str)
+      ("training-mode", ProgOpts::value<STRING_T>(), training_mode_str)
+      ("stratified-blocks", ProgOpts::value<INT_T>(), stratified_blocks_str)
+      ("epoch-order", ProgOpts::value<STRING_T>(), epoch_order_str)
+      ("order-block-size", ProgOpts::value<INT_T>(), order_block_size_str)
+      ("overlap-validation", ProgOpts::value<INT_T>(), overlap_validation_str)
+      ("optimizer", ProgOpts::value<STRING_T>(), optimizer_str)
+      ("optimizer-beta1", ProgOpts::value<FLT_T>(), optimizer_beta1_str)
+      ("optimizer-beta2", ProgOpts::value<FLT_T>(), optimizer_beta2_str)
+      ("optimizer-epsilon", ProgOpts::value<FLT_T>(), optimizer_epsilon_str)
+      ("target-rmse", ProgOpts::value<FLT_T>(), target_rmse_str)
       ; // leave this semi colon at end don't move this
 
     ProgOpts::store(ProgOpts::parse_command_line(argc, argv, desc), varMap);
@@ -127,10 +221,10 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
 
     OPT(num_factors , "num-factors", INT_T,  5);
     OPT(default_rating ,"default-rating" , FLT_T,  2.8485);
-    OPT(regularization_param_p ,"regularization-param-p", FLT_T,  0.002);
-    OPT(regularization_param_q ,"regularization-param-q", FLT_T,  0.002);
-    OPT(learning_rate_p ,"learning-rate-p", FLT_T,  0.000002);
-    OPT(learning_rate_q ,"learning-rate-q", FLT_T,  0.000002);
+    OPT(regularization_param_p ,"regularization-param-p", FLT_T,  0.000002);
+    OPT(regularization_param_q ,"regularization-param-q", FLT_T,  0.000002);
+    OPT(learning_rate_p ,"learning-rate-p", FLT_T,  0.002);
+    OPT(learning_rate_q ,"learning-rate-q", FLT_T,  0.002);
     OPT(gradient_descent_iteration_count ,"gradient-descent-iteration-count", INT_T,  100);
     OPT(training_sample_percentage ,"training-sample-percentage", FLT_T,  0.70);
     OPT(max_row_dim ,"max-row-dimension", INT_T,  100000000);
@@ -139,6 +233,37 @@ bool processInputArgs(int argc, char * argv[], ProgOpts::variables_map &varMap,
     OPT(verbose_mode_level ,"verbose-mode-level", INT_T,  0);
     OPT(loop_mode_count ,"loop-mode-count", INT_T,  1);
     OPT(p_q_matrix_output_file_path, "p-q-matrix-output-file-path", STRING_T,  STRING_T("P_Q_matrix.mtx"));
+    OPT(relabel_ids, "relabel-ids", INT_T, 0);
+    OPT(max_threads_count, "max-threads-count", INT_T, 0);
+    OPT(training_mode, "training-mode", STRING_T, STRING_T("sgd"));
+    OPT(stratified_blocks, "stratified-blocks", INT_T, 32);
+    OPT(epoch_order, "epoch-order", STRING_T, STRING_T("shuffle"));
+    OPT(order_block_size, "order-block-size", INT_T, 1024);
+    OPT(overlap_validation, "overlap-validation", INT_T, 1);
+    OPT(optimizer, "optimizer", STRING_T, STRING_T("sgd"));
+    OPT(optimizer_beta1, "optimizer-beta1", FLT_T, 0.9);
+    OPT(optimizer_beta2, "optimizer-beta2", FLT_T, 0.999);
+    OPT(optimizer_epsilon, "optimizer-epsilon", FLT_T, 1e-8);
+    OPT(target_rmse, "target-rmse", FLT_T, 0);
+    if(params.training_mode != "sgd" && params.training_mode != "hogwild" &&
+      params.training_mode != "stratified" && params.training_mode != "als") {
+      cerr << "\n --training-mode must be 'sgd', 'hogwild', 'stratified' or 'als'\n";
+      return false;
+    }
+    if(params.epoch_order != "shuffle" && params.epoch_order != "user-blocked" &&
+      params.epoch_order != "item-blocked" && params.epoch_order != "hilbert") {
+      cerr << "\n --epoch-order must be 'shuffle', 'user-blocked', 'item-blocked' or 'hilbert'\n";
+      return false;
+    }
+    if(params.optimizer != "sgd" && params.optimizer != "adagrad" &&
+      params.optimizer != "rmsprop" && params.optimizer != "adam") {
+      cerr << "\n --optimizer must be 'sgd', 'adagrad', 'rmsprop' or 'adam'\n";
+      return false;
+    }
+    if(params.optimizer != "sgd" && params.training_mode == "als") {
+      cerr << "\n --optimizer applies to the sgd, hogwild and stratified modes\n";
+      return false;
+    }
 
   }
   catch(exception &e)
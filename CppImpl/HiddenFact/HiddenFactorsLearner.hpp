@@ -6,13 +6,58 @@
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include <chrono>
+#include <random>
+#include <thread>
 
 #include "../utils/Utils.hpp"
 #include "../utils/Mtx.hpp"
+#include "../utils/FactorMtx.hpp"
+#include "../utils/CSRMtx.hpp"
+#include "../utils/IdRelabeler.hpp"
+#include "../utils/RatingEvaluator.hpp"
+
+// ratings ahead of the SGD loop whose factor rows are prefetched
+#define SGD_PREFETCH_DISTANCE 16
 
 // random generator function:
 inline int newRandom (int i) { return std::rand()%i; }
 
+// Solves A x = b for a symmetric positive definite k x k row major A,
+// x is returned in b and A is overwritten by its Cholesky factor L.
+// false if A is not positive definite.
+inline bool choleskySolve(vector<double> &A, vector<double> &b, INT_T k)
+{
+  for(INT_T j=0; j<k; j++) {
+    double d = A[j*k + j];
+    for(INT_T m=0; m<j; m++)
+      d -= A[j*k + m] * A[j*k + m];
+    if(d <= 0)
+      return false;
+    d = sqrt(d);
+    A[j*k + j] = d;
+    for(INT_T r=j+1; r<k; r++) {
+      double v = A[r*k + j];
+      for(INT_T m=0; m<j; m++)
+        v -= A[r*k + m] * A[j*k + m];
+      A[r*k + j] = v / d;
+    }
+  }
+  for(INT_T r=0; r<k; r++) { // L y = b
+    double v = b[r];
+    for(INT_T m=0; m<r; m++)
+      v -= A[r*k + m] * b[m];
+    b[r] = v / A[r*k + r];
+  }
+  for(INT_T r=k-1; r>=0; r--) { // L' x = y
+    double v = b[r];
+    for(INT_T m=r+1; m<k; m++)
+      v -= A[m*k + r] * b[m];
+    b[r] = v / A[r*k + r];
+  }
+  return true;
+}
+
 typedef struct RatingEntry {
   INT_T user_id;
   INT_T item_id;
@@ -20,6 +65,58 @@ typedef struct RatingEntry {
   RatingEntry(INT_T u, INT_T i, INT_T r) : user_id(u), item_id(i), rating(r) { }
 } RatingEntry;
 
+// T1' with coded ids, one array per field in the order an epoch visits
+// the ratings, so the epoch loop streams the three arrays
+typedef struct TRAIN_SET_T {
+  vector<INT_T> usr;
+  vector<INT_T> itm;
+  vector<unsigned char> rating;
+
+  INT_T size() const { return usr.size(); }
+  void clear() { usr.clear(); itm.clear(); rating.clear(); }
+  void reserve(INT_T n) { usr.reserve(n); itm.reserve(n); rating.reserve(n); }
+  void push_back(INT_T u, INT_T i, unsigned char r)
+  {
+    usr.push_back(u);
+    itm.push_back(i);
+    rating.push_back(r);
+  }
+  void swapEntries(INT_T a, INT_T b)
+  {
+    std::swap(usr[a], usr[b]);
+    std::swap(itm[a], itm[b]);
+    std::swap(rating[a], rating[b]);
+  }
+  // entry x becomes the old entry positions[x]
+  void reorder(const vector<INT_T> &positions)
+  {
+    TRAIN_SET_T o;
+    o.reserve(positions.size());
+    for(INT_T x=0; x<positions.size(); x++)
+      o.push_back(usr[positions[x]], itm[positions[x]], rating[positions[x]]);
+    std::swap(*this, o);
+  }
+} TRAIN_SET_T;
+
+// Position of cell (x, y) along the Hilbert curve filling an n x n grid,
+// n a power of two. Neighbouring positions are neighbouring cells.
+inline long long hilbertIndex(long long n, long long x, long long y)
+{
+  long long d = 0;
+  for(long long s = n / 2; s > 0; s /= 2) {
+    long long rx = (x & s) > 0, ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    if(ry == 0) { // rotate the quadrant
+      if(rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
 struct MatrixFactorizationParams {
   INT_T num_factors;
   FLT_T default_rating;
@@ -35,6 +132,18 @@ struct MatrixFactorizationParams {
   STRING_T p_q_matrix_output_file_path;
   INT_T verbose_mode_level;
   INT_T loop_mode_count;
+  INT_T relabel_ids;
+  INT_T max_threads_count;
+  INT_T stratified_blocks;
+  INT_T order_block_size;
+  INT_T overlap_validation;
+  STRING_T epoch_order;
+  STRING_T optimizer;
+  FLT_T optimizer_beta1;
+  FLT_T optimizer_beta2;
+  FLT_T optimizer_epsilon;
+  FLT_T target_rmse;
+  STRING_T training_mode;
 
   void print() {
     cout << "\n\n--------------- training parameters ---------------\n";
@@ -49,6 +158,18 @@ struct MatrixFactorizationParams {
       << " max_row_dim: " << max_row_dim << "\n"
       << " max_col_dim: " << max_col_dim << "\n"
       << " gradient_descent_iteration_count: " << gradient_descent_iteration_count << "\n"
+      << " relabel_ids: " << relabel_ids << "\n"
+      << " max_threads_count: " << max_threads_count << "\n"
+      << " training_mode: " << training_mode << "\n"
+      << " stratified_blocks: " << stratified_blocks << "\n"
+      << " epoch_order: " << epoch_order << "\n"
+      << " order_block_size: " << order_block_size << "\n"
+      << " overlap_validation: " << overlap_validation << "\n"
+      << " optimizer: " << optimizer << "\n"
+      << " optimizer_beta1: " << optimizer_beta1 << "\n"
+      << " optimizer_beta2: " << optimizer_beta2 << "\n"
+      << " optimizer_epsilon: " << optimizer_epsilon << "\n"
+      << " target_rmse: " << target_rmse << "\n"
       << " csv_input_file_path: " << csv_input_file_path << "\n";
       cout << "-------------------------------------------------\n\n\n";
   }
@@ -58,6 +179,8 @@ class MatrixFactorization {
   MatrixFactorizationParams algoParams;
   vector<RatingEntry> * ratingsList;
   vector<INT_T> ratingsListShuffle;
+  vector<TEST_RATING_T> testSet; // T2', coded ids grouped by user
+  TRAIN_SET_T trainSet; // T1', shuffled (stratified mode: block by block)
   vector<INT_T> user_index_table; // user index
   vector<INT_T> item_index_table; // movie index
   const long long MAX_USERS, MAX_ITEMS;
@@ -67,11 +190,30 @@ class MatrixFactorization {
   vector<INT_T> iidMap; // FIXME: iidMap and item_index_table are copies remove one
   FLT_T oldRMSE;
   INT_T train_start, train_end, test_start, test_end;
-  Mtx *P, *Q, *Pstar, *Qstar;
-  FLT_T lambda_p, lambda_q;
-  FLT_T eta_p, eta_q;
+  FactorMtx *P, *Q, *Pstar, *Qstar; // users x K and items x K
+  // overlap_validation: the last epoch's model, validated while the next
+  // epoch trains P and Q. An improving snapshot trades places with
+  // Pstar / Qstar, the best model is never copied.
+  FactorMtx *Psnap, *Qsnap;
+  // optimizer other than sgd: its state rides in the P and Q rows, slot 1
+  // the squared step sums / averages, for Adam slot 2 the step averages
+  // and the tail the row's beta1^t, beta2^t after its t steps
+  INT_T optimizerKind;
+  FLT_T lambda_p, lambda_q; // regularization
+  FLT_T eta_p, eta_q;       // learning rate (SGD step)
   FLT_T finalRMSE;
   INT_T iterations;
+  // stratified mode: T1' split into a numBlocks x numBlocks grid of user
+  // block x item block, block b is trainSet[blockStart[b] .. blockStart[b+1])
+  INT_T numBlocks;
+  vector<INT_T> blockStart;
+  // epoch_order other than shuffle: trainSet grouped into blocks
+  // trainSet[orderStart[b] .. orderStart[b+1]), shuffled within each
+  // block every epoch
+  vector<INT_T> orderStart;
+  std::mt19937 orderGen;
+  // als mode: T1' by user and by item, coded ids
+  CSRMtx alsUsrRatings, alsItmRatings;
 
   void printMaps(vector<INT_T> &vi, const char *s) {
     cout << s << "\n";
@@ -144,9 +286,29 @@ class MatrixFactorization {
         iidRMap[iid] = i;
         i++;
     }
+    if(algoParams.relabel_ids)
+      relabelUserAndItemIndexes();
      writeItemAndUserIndexTables();
   }
 
+  // most active users and most popular items get the smallest coded ids
+  // so their P rows and Q columns are packed together
+  void relabelUserAndItemIndexes() {
+    vector<long long> usrCounts(user_index_table.size(), 0);
+    vector<long long> itmCounts(item_index_table.size(), 0);
+    for(INT_T i = 0; i < ratingsList->size(); i++) {
+      RatingEntry &re = ratingsList->at(i);
+      usrCounts[uidRMap[re.user_id]]++;
+      itmCounts[iidRMap[re.item_id]]++;
+    }
+    relabelByCount(user_index_table, usrCounts);
+    relabelByCount(item_index_table, itmCounts);
+    updateReverseMap(user_index_table, uidRMap);
+    updateReverseMap(item_index_table, iidRMap);
+    uidMap = user_index_table;
+    iidMap = item_index_table;
+  }
+
   void shuffleRatingsListIndexes() {
     std::srand(std::time(0));
     random_shuffle(ratingsListShuffle.begin(), ratingsListShuffle.end(), newRandom);
@@ -206,11 +368,25 @@ class MatrixFactorization {
       return;
     }
 
-    P = new Mtx(user_index_table.size(), algoParams.num_factors, algoParams.default_rating);
-    Q = new Mtx(algoParams.num_factors, item_index_table.size(), algoParams.default_rating);
+    INT_T slots = optimizerKind == OPTIMIZER_SGD ? 1 : optimizerKind == OPTIMIZER_ADAM ? 3 : 2;
+    INT_T tailSize = optimizerKind == OPTIMIZER_ADAM ? 2 : 0;
+    P = new FactorMtx(user_index_table.size(), algoParams.num_factors, algoParams.default_rating,
+      slots, tailSize);
+    Q = new FactorMtx(item_index_table.size(), algoParams.num_factors, algoParams.default_rating,
+      slots, tailSize);
+    if(optimizerKind == OPTIMIZER_ADAM) {
+      for(INT_T u=0; u<P->rows; u++)
+        P->tail(u)[0] = P->tail(u)[1] = 1;
+      for(INT_T i=0; i<Q->rows; i++)
+        Q->tail(i)[0] = Q->tail(i)[1] = 1;
+    }
 
-    Pstar = new Mtx(user_index_table.size(), algoParams.num_factors, algoParams.default_rating);
-    Qstar = new Mtx(algoParams.num_factors, item_index_table.size(), algoParams.default_rating);
+    Pstar = new FactorMtx(user_index_table.size(), algoParams.num_factors, algoParams.default_rating);
+    Qstar = new FactorMtx(item_index_table.size(), algoParams.num_factors, algoParams.default_rating);
+    if(algoParams.overlap_validation) {
+      Psnap = new FactorMtx(user_index_table.size(), algoParams.num_factors, algoParams.default_rating);
+      Qsnap = new FactorMtx(item_index_table.size(), algoParams.num_factors, algoParams.default_rating);
+    }
   }
 
   inline void partitionAsTrainingAndValidationSets(vector<RatingEntry> &T) {
@@ -218,22 +394,27 @@ class MatrixFactorization {
     train_start = 0;
     train_end = test_start = (INT_T) tpct;
     test_end = T.size();
-  }
 
-  FLT_T getPredictedRating5(INT_T u, INT_T i) {
-    FLT_T r =
-      P->get(u,0) * Q->get(0,i) + P->get(u,1) * Q->get(1,i) +
-      P->get(u,2) * Q->get(2,i) + P->get(u,3) * Q->get(3,i) +
-      P->get(u,4) * Q->get(4,i);
-    return r;
+    trainSet.clear();
+    trainSet.reserve(train_end - train_start);
+    for(INT_T x=train_start; x<train_end; x++) {
+      RatingEntry &re = T[ratingsListShuffle[x]];
+      if(re.rating < 0 || re.rating > 255)
+        throw("MatrixFactorization::partitionAsTrainingAndValidationSets rating outside 0..255");
+      trainSet.push_back(uidRMap[re.user_id], iidRMap[re.item_id], re.rating);
+    }
+
+    testSet.clear();
+    testSet.reserve(test_end - test_start);
+    for(INT_T x=test_start; x<test_end; x++) {
+      RatingEntry &re = T[ratingsListShuffle[x]];
+      testSet.push_back(TEST_RATING_T(uidRMap[re.user_id], iidRMap[re.item_id], re.rating));
+    }
+    sort(testSet.begin(), testSet.end());
   }
 
   FLT_T getPredictedRating(INT_T u, INT_T i) {
-    FLT_T r = 0;
-    for (INT_T k=0; k<algoParams.num_factors; k++){
-      r += P->get(u,k) * Q->get(k,i);
-    }
-    return r;
+    return factorDot(P->row(u), Q->row(i), P->stride);
   }
 
   FLT_T getEui(INT_T u, INT_T i, FLT_T rui) {
@@ -242,85 +423,310 @@ class MatrixFactorization {
     return eui;
   }
 
-  FLT_T getRMSEforT2dash(vector<RatingEntry> &T) {
-    INT_T count = 0;
-    FLT_T sse = 0;
-    for(INT_T x=test_start; x<test_end; x++) {
-      INT_T y = ratingsListShuffle[x];
-
-      INT_T u = T[y].user_id;
-      INT_T i = T[y].item_id;
-      FLT_T r_ui = T[y].rating;
-
-      u = uidRMap[u];
-      i = iidRMap[i];
+  // of the model p, q over T2', in parallel batches of the user grouped
+  // testSet. Only reads p and q, safe next to training on other matrices.
+  FLT_T getRMSEforT2dash(const FactorMtx *p, const FactorMtx *q) {
+    EVAL_RESULT_T res = evaluateRatings(testSet,
+      [p, q](INT_T u, INT_T i) { return factorDot(p->row(u), q->row(i), p->stride); },
+      algoParams.max_threads_count);
+    if(algoParams.verbose_mode_level > 1)
+      res.print("T2'");
+    return res.rmse;
+  }
 
-      FLT_T rcap_ui = getPredictedRating(u,i);
-      FLT_T e_ui = r_ui - rcap_ui;
-      sse += (e_ui * e_ui);
-      count++;
+  // one gradient step on r_ui, every SGD mode updates P and Q here.
+  // Common K get a kernel unrolled for them, others run over the padded
+  // row.
+  inline void sgdUpdate(INT_T u, INT_T i, FLT_T rui) {
+    if(optimizerKind != OPTIMIZER_SGD) {
+      adaptiveUpdate(u, i, rui);
+      return;
+    }
+    FLT_T *p = P->row(u), *q = Q->row(i);
+    switch(algoParams.num_factors) {
+    case 8: factorSgdStep<8>(p, q, rui, eta_p, eta_q, lambda_p, lambda_q); break;
+    case 16: factorSgdStep<16>(p, q, rui, eta_p, eta_q, lambda_p, lambda_q); break;
+    case 32: factorSgdStep<32>(p, q, rui, eta_p, eta_q, lambda_p, lambda_q); break;
+    case 64: factorSgdStep<64>(p, q, rui, eta_p, eta_q, lambda_p, lambda_q); break;
+    case 128: factorSgdStep<128>(p, q, rui, eta_p, eta_q, lambda_p, lambda_q); break;
+    default: factorSgdStep(p, q, rui, P->stride, eta_p, eta_q, lambda_p, lambda_q);
     }
-    FLT_T rmse = sqrt(sse/count);
-    return rmse;
   }
 
-  void updatePu(INT_T u, INT_T i, INT_T k, FLT_T e_ui) { // non simultaneous update
-    FLT_T p_uk = P->get(u,k);
-    FLT_T q_ki = Q->get(k,i);
-
-    FLT_T pdash_uk = p_uk + eta_p * ((e_ui * q_ki) - (lambda_p * p_uk));
-    P->set(u,k,pdash_uk);
+  // the step of sgdUpdate with --optimizer's per parameter step sizes,
+  // eta_p / eta_q are the base step
+  inline void adaptiveUpdate(INT_T u, INT_T i, FLT_T rui) {
+    FLT_T *p = P->row(u), *q = Q->row(i), *vp = P->slot(u, 1), *vq = Q->slot(i, 1);
+    FLT_T beta1 = algoParams.optimizer_beta1, beta2 = algoParams.optimizer_beta2;
+    FLT_T epsilon = algoParams.optimizer_epsilon;
+    if(optimizerKind == OPTIMIZER_ADAGRAD)
+      factorAdaptiveStep<OPTIMIZER_ADAGRAD>(p, q, vp, vq, 0, 0, rui, P->stride,
+        eta_p, eta_q, lambda_p, lambda_q, beta1, beta2, epsilon);
+    else if(optimizerKind == OPTIMIZER_RMSPROP)
+      factorAdaptiveStep<OPTIMIZER_RMSPROP>(p, q, vp, vq, 0, 0, rui, P->stride,
+        eta_p, eta_q, lambda_p, lambda_q, beta1, beta2, epsilon);
+    else {
+      // bias correction sqrt(1 - beta2^t) / (1 - beta1^t) of the row's
+      // t-th step, rows are stepped unevenly so each keeps its own t
+      FLT_T *pu = P->tail(u), *qi = Q->tail(i);
+      stepAdamPowers(pu, beta1, beta2);
+      stepAdamPowers(qi, beta1, beta2);
+      FLT_T step_p = eta_p * sqrt(1 - pu[1]) / (1 - pu[0]);
+      FLT_T step_q = eta_q * sqrt(1 - qi[1]) / (1 - qi[0]);
+      factorAdaptiveStep<OPTIMIZER_ADAM>(p, q, vp, vq, P->slot(u, 2), Q->slot(i, 2),
+        rui, P->stride, step_p, step_q, lambda_p, lambda_q, beta1, beta2, epsilon);
+    }
   }
 
-  void updateQi(INT_T u, INT_T i, INT_T k, FLT_T e_ui) { // non simultaneous update
-    FLT_T p_uk = P->get(u,k);
-    FLT_T q_ki = Q->get(k,i);
-
-    FLT_T qdash_ki = q_ki + eta_q * ((e_ui * p_uk) - (lambda_q * q_ki));
-    Q->set(k,i,qdash_ki);
+  // one more step of a row's beta1^t, beta2^t (pow[0], pow[1]), a power
+  // past float precision is held at 0 instead of going denormal (slow) on
+  // the rows of popular items
+  static void stepAdamPowers(FLT_T *pow, FLT_T beta1, FLT_T beta2) {
+    pow[0] = pow[0] < 1e-20 ? 0 : pow[0] * beta1;
+    pow[1] = pow[1] < 1e-20 ? 0 : pow[1] * beta2;
+  }
+
+  // trainSet[first, last). The coded ids of the coming ratings are right
+  // there in the arrays, so their P and Q rows are fetched
+  // SGD_PREFETCH_DISTANCE ratings ahead instead of stalling on each one.
+  void sgdUpdateRange(INT_T first, INT_T last) {
+    const INT_T *usr = trainSet.usr.data(), *itm = trainSet.itm.data();
+    const unsigned char *rating = trainSet.rating.data();
+    for(INT_T x=first; x<last; x++) {
+      if(x + SGD_PREFETCH_DISTANCE < last) {
+        P->prefetchRow(usr[x + SGD_PREFETCH_DISTANCE]);
+        Q->prefetchRow(itm[x + SGD_PREFETCH_DISTANCE]);
+      }
+      sgdUpdate(usr[x], itm[x], rating[x]);
+    }
   }
 
-  void updatePuAndQiNonSimultaneous(INT_T u, INT_T i, INT_T k, FLT_T eui) { // non simultaneous update
-    updatePu(u,i,k,eui);
-    updateQi(u,i,k,eui);
+  // Hogwild: each thread runs SGD over its own contiguous shard of the
+  // shuffled T1' and writes P and Q with no locks. Ratings are sparse so
+  // two threads seldom hit the same row at once, an overwritten update
+  // only loses a little progress.
+  void doHogwildEpoch() {
+    INT_T threadCount = poolThreadCount(algoParams.max_threads_count);
+    INT_T shardSize = (trainSet.size() + threadCount - 1) / threadCount;
+    parallelForBatches(trainSet.size(), shardSize, threadCount,
+      [&](long long first, long long last, INT_T t) {
+        sgdUpdateRange(first, last);
+      });
+  }
+
+  // coded ids 0..counts.size()-1 into numBlocks ranges of about the
+  // same number of ratings, so popular items do not pile up in one block
+  void balancedBlocks(const vector<long long> &counts, vector<INT_T> &blockOf) {
+    long long total = 0, seen = 0;
+    for(INT_T x=0; x<counts.size(); x++)
+      total += counts[x];
+    blockOf.resize(counts.size());
+    for(INT_T x=0; x<counts.size(); x++) {
+      blockOf[x] = min(numBlocks - 1, (INT_T) (seen * numBlocks / max(1LL, total)));
+      seen += counts[x];
+    }
   }
 
-  void updatePu(FLT_T p_uk, FLT_T q_ki, INT_T k, FLT_T e_ui, INT_T u) { // simultaneous update
-    FLT_T pdash_uk = p_uk + eta_p * ((e_ui * q_ki) - (lambda_p * p_uk));
-    P->set(u,k,pdash_uk);
+  // regroups trainSet block by block, shuffled order within a block
+  void buildStratifiedBlocks() {
+    numBlocks = algoParams.stratified_blocks > 0 ? algoParams.stratified_blocks :
+      poolThreadCount(algoParams.max_threads_count);
+    if(numBlocks < poolThreadCount(algoParams.max_threads_count))
+      cout << " stratified SGD " << numBlocks << " blocks leave threads idle, "
+        << poolThreadCount(algoParams.max_threads_count) << " threads\n";
+    vector<long long> usrCounts(user_index_table.size(), 0);
+    vector<long long> itmCounts(item_index_table.size(), 0);
+    for(INT_T x=0; x<trainSet.size(); x++) {
+      usrCounts[trainSet.usr[x]]++;
+      itmCounts[trainSet.itm[x]]++;
+    }
+    vector<INT_T> usrBlock, itmBlock;
+    balancedBlocks(usrCounts, usrBlock);
+    balancedBlocks(itmCounts, itmBlock);
+
+    vector<INT_T> blockOf(trainSet.size());
+    blockStart.assign(numBlocks * numBlocks + 1, 0);
+    for(INT_T x=0; x<trainSet.size(); x++) {
+      blockOf[x] = usrBlock[trainSet.usr[x]] * numBlocks + itmBlock[trainSet.itm[x]];
+      blockStart[blockOf[x] + 1]++;
+    }
+    for(INT_T b=0; b<numBlocks * numBlocks; b++)
+      blockStart[b + 1] += blockStart[b];
+    vector<INT_T> fill(blockStart.begin(), blockStart.end() - 1);
+    TRAIN_SET_T blocked;
+    blocked.usr.resize(trainSet.size());
+    blocked.itm.resize(trainSet.size());
+    blocked.rating.resize(trainSet.size());
+    for(INT_T x=0; x<trainSet.size(); x++) {
+      INT_T y = fill[blockOf[x]]++;
+      blocked.usr[y] = trainSet.usr[x];
+      blocked.itm[y] = trainSet.itm[x];
+      blocked.rating[y] = trainSet.rating[x];
+    }
+    std::swap(trainSet, blocked);
+    if(algoParams.verbose_mode_level > 0)
+      cout << " stratified SGD " << numBlocks << " x " << numBlocks << " blocks\n";
+  }
+
+  // An epoch is numBlocks strata. Stratum s holds the blocks
+  // (b, (b + s) % numBlocks), which share no user block and no item block,
+  // so the threads running them never write the same P or Q entries and
+  // the result does not depend on the thread count or timing.
+  void doStratifiedEpoch() {
+    INT_T threadCount = poolThreadCount(algoParams.max_threads_count);
+    for(INT_T s=0; s<numBlocks; s++) {
+      parallelForBatches(numBlocks, 1, threadCount,
+        [&](long long b, long long, INT_T t) {
+          INT_T blk = b * numBlocks + (b + s) % numBlocks;
+          sgdUpdateRange(blockStart[blk], blockStart[blk + 1]);
+        });
+    }
   }
 
-  void updateQi(FLT_T p_uk, FLT_T q_ki, INT_T k, FLT_T e_ui, INT_T i) { // simultaneous update
-    FLT_T qdash_ki = q_ki + eta_q * ((e_ui * p_uk) - (lambda_q * q_ki));
-    Q->set(k,i,qdash_ki);
-  }
+  void buildAlsRatings() {
+    vector<CSR_ENTRY_T> entries;
+    entries.reserve(trainSet.size());
+    for(INT_T x=0; x<trainSet.size(); x++)
+      entries.push_back(CSR_ENTRY_T(trainSet.usr[x], trainSet.itm[x], trainSet.rating[x]));
+    alsUsrRatings = CSRMtx(user_index_table.size(), item_index_table.size(), entries);
+    alsUsrRatings.transpose(alsItmRatings);
 
-  void updatePuAndQiSimultaneous(INT_T u, INT_T i, INT_T k, FLT_T e_ui) { // simultaneous update
-    FLT_T p_uk = P->get(u,k);
-    FLT_T q_ki = Q->get(k,i);
-    updatePu(p_uk, q_ki, k, e_ui, u);
-    updateQi(p_uk, q_ki, k, e_ui, i);
+    // with every factor at default_rating all K of them solve the same
+    // equations and stay equal, scatter Q's start around it
+    for(INT_T i=0; i<Q->rows; i++) {
+      for(INT_T k=0; k<Q->K; k++)
+        Q->set(i, k, algoParams.default_rating * (0.5 + (FLT_T) std::rand() / RAND_MAX));
+    }
   }
 
-  inline void do_for_each_element_of_T1dash(vector<RatingEntry> &T) {
-    for(INT_T x=0; x<train_end; x++) {
-      INT_T y = ratingsListShuffle[x];
+  // Least squares for every row r of R with the other side's factors
+  // fixed: x_r = (sum_c y_c y_c' + lambda n_r I)^-1 sum_c r_rc y_c over the
+  // n_r rated columns c. fixed(c, k) is y_c[k], set(r, k, v) stores x_r[k].
+  // Rows are independent, threads take batches of them and write only
+  // their own rows. Rows without ratings keep their factors.
+  template<typename FIXED_FN, typename SET_FN>
+  void alsSolveRows(const CSRMtx &R, FLT_T lambda, FIXED_FN fixed, SET_FN set) {
+    INT_T K = algoParams.num_factors;
+    INT_T threadCount = poolThreadCount(algoParams.max_threads_count);
+    vector< vector<double> > A(threadCount), b(threadCount), y(threadCount);
+
+    parallelForBatches(R.rows, 64, threadCount,
+      [&](long long first, long long last, INT_T t) {
+        A[t].resize(K * K);
+        b[t].resize(K);
+        y[t].resize(K);
+        for(INT_T r=first; r<last; r++) {
+          INT_T n = R.rowSize(r);
+          if(n == 0)
+            continue;
+          const INT_T *cols = R.rowCols(r);
+          const FLT_T *ratings = R.rowVals(r);
+          fill(A[t].begin(), A[t].end(), 0.0);
+          fill(b[t].begin(), b[t].end(), 0.0);
+          for(INT_T x=0; x<n; x++) {
+            for(INT_T k=0; k<K; k++)
+              y[t][k] = fixed(cols[x], k);
+            for(INT_T k=0; k<K; k++) {
+              b[t][k] += ratings[x] * y[t][k];
+              for(INT_T m=0; m<=k; m++)
+                A[t][k*K + m] += y[t][k] * y[t][m];
+            }
+          }
+          for(INT_T k=0; k<K; k++) {
+            A[t][k*K + k] += lambda * n;
+            for(INT_T m=0; m<k; m++)
+              A[t][m*K + k] = A[t][k*K + m];
+          }
+          if(!choleskySolve(A[t], b[t], K))
+            continue;
+          for(INT_T k=0; k<K; k++)
+            set(r, k, b[t][k]);
+        }
+      });
+  }
+
+  // one ALS sweep, P given Q then Q given P
+  void doAlsEpoch() {
+    alsSolveRows(alsUsrRatings, algoParams.regularization_param_p,
+      [this](INT_T i, INT_T k) { return Q->get(i, k); },
+      [this](INT_T u, INT_T k, double v) { P->set(u, k, v); });
+    alsSolveRows(alsItmRatings, algoParams.regularization_param_q,
+      [this](INT_T u, INT_T k) { return P->get(u, k); },
+      [this](INT_T i, INT_T k, double v) { Q->set(i, k, v); });
+  }
+
+  // Groups trainSet for cache reuse, blocks of order_block_size ids:
+  // user-blocked keeps the ratings of a block of users (so their P rows)
+  // together, item-blocked the same for items and Q, hilbert walks
+  // (user block, item block) cells along a Hilbert curve so both stay
+  // close. Within a block the shuffled order is kept.
+  void buildEpochOrder() {
+    orderStart.clear();
+    if(algoParams.epoch_order == "shuffle")
+      return;
+    INT_T B = max(1, algoParams.order_block_size);
+    long long n = 1;
+    while(n * B < max(user_index_table.size(), item_index_table.size()))
+      n *= 2;
+    bool hilbert = algoParams.epoch_order == "hilbert";
+    long long numKeys = hilbert ? n * n : n;
+    if(numKeys > (1 << 28))
+      throw("MatrixFactorization::buildEpochOrder --order-block-size too small for hilbert");
+
+    // a counting sort on the block keeps the shuffled order within it
+    vector<INT_T> keys(trainSet.size());
+    for(INT_T x=0; x<trainSet.size(); x++) {
+      long long u = trainSet.usr[x] / B, i = trainSet.itm[x] / B;
+      if(algoParams.epoch_order == "user-blocked")
+        keys[x] = u;
+      else if(algoParams.epoch_order == "item-blocked")
+        keys[x] = i;
+      else
+        keys[x] = hilbertIndex(n, u, i);
+    }
+    vector<INT_T> keyStart(numKeys + 1, 0);
+    for(INT_T x=0; x<keys.size(); x++)
+      keyStart[keys[x] + 1]++;
+    for(long long k=0; k<numKeys; k++) {
+      if(keyStart[k + 1])
+        orderStart.push_back(keyStart[k]);
+      keyStart[k + 1] += keyStart[k];
+    }
+    orderStart.push_back(keys.size());
 
-      INT_T u = T[y].user_id;
-      INT_T i = T[y].item_id;
-      FLT_T rui = T[y].rating;
+    vector<INT_T> positions(keys.size());
+    for(INT_T x=0; x<keys.size(); x++)
+      positions[keyStart[keys[x]]++] = x;
+    trainSet.reorder(positions);
+    orderGen.seed(std::rand());
+    if(algoParams.verbose_mode_level > 0)
+      cout << " epoch order " << algoParams.epoch_order << " "
+        << orderStart.size() - 1 << " blocks\n";
+  }
 
-      u = uidRMap[u];
-      i = iidRMap[i];
-      FLT_T eui = getEui(u, i, rui);
-      //cout << "eui " << eui << "\n";
-      for(INT_T k=0; k < algoParams.num_factors; k++) {
-        updatePuAndQiSimultaneous(u,i,k,eui);
-        // updatePuAndQiNonSimultaneous(u,i,k,eui);
+  // new order within every block, the blocks stay where they are
+  void reshuffleWithinBlocks() {
+    for(INT_T b=0; b+1<orderStart.size(); b++) {
+      for(INT_T x=orderStart[b+1]-1; x>orderStart[b]; x--) {
+        std::uniform_int_distribution<INT_T> pick(orderStart[b], x);
+        trainSet.swapEntries(x, pick(orderGen));
       }
     }
   }
 
+  inline void do_for_each_element_of_T1dash() {
+    if(orderStart.size())
+      reshuffleWithinBlocks();
+    if(algoParams.training_mode == "als")
+      doAlsEpoch();
+    else if(algoParams.training_mode == "hogwild")
+      doHogwildEpoch();
+    else if(algoParams.training_mode == "stratified")
+      doStratifiedEpoch();
+    else
+      sgdUpdateRange(0, trainSet.size());
+  }
+
   void updateQandP() {
     P->copy(Pstar);
     Q->copy(Qstar);
@@ -331,15 +737,41 @@ class MatrixFactorization {
       cout << "doMatrixFactorization " << "\n";
 
     partitionAsTrainingAndValidationSets(*T);
+    // with one hardware thread validation would only take turns with training
+    if(algoParams.overlap_validation && resolveThreadCount(0) < 2) {
+      cout << " one hardware thread, validating between epochs\n";
+      algoParams.overlap_validation = 0;
+    }
     initializeQandPmatrices();
+    if(algoParams.training_mode == "stratified")
+      buildStratifiedBlocks();
+    if(algoParams.training_mode == "als")
+      buildAlsRatings();
+    // training wall time, the one time ordering included, for comparing
+    // how fast the epoch orders bring the RMSE down
+    std::chrono::steady_clock::time_point setupStart = std::chrono::steady_clock::now();
+    if(algoParams.training_mode == "sgd" || algoParams.training_mode == "hogwild")
+      buildEpochOrder();
+    double trainSecs = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - setupStart).count();
+    FLT_T firstRMSE = NAN, lastRMSE = NAN;
     INT_T count = 0;
     FLT_T olddiff = 9999999;
-
-    while(!terminalConditionMet()) {
-      do_for_each_element_of_T1dash(*T);
-      // for each element (u,i,rui) of T1'
-      FLT_T newRMSE = getRMSEforT2dash(*T);
-
+    // time training waits on validation: all of it serially, only the
+    // snapshot copy and what is left at the join overlapped
+    double validationSecs = 0;
+
+    // epoch count's result, true when the stop rule ends training
+    auto validated = [&](FLT_T newRMSE, double secs, bool improvedSwap) -> bool {
+      trainSecs += secs;
+      if(isnan(firstRMSE))
+        firstRMSE = newRMSE;
+      lastRMSE = newRMSE;
+
+      cout << " epoch " << count << " " << algoParams.training_mode << " "
+        << (train_end - train_start) << " updates in " << secs << " s, "
+        << (train_end - train_start) / secs << " updates/sec, T2' RMSE "
+        << newRMSE << " after " << trainSecs << " s training\n";
       if(algoParams.verbose_mode_level > 0)
         cout << "iteration: " << count << " RMSE: " << newRMSE << "\n";
       count++;
@@ -349,18 +781,88 @@ class MatrixFactorization {
           diff *= -1;
       }
 
-      if(diff > olddiff) {
+      if(algoParams.target_rmse > 0 && newRMSE <= algoParams.target_rmse) {
+        cout << " target T2' RMSE " << algoParams.target_rmse << " reached after "
+          << count << " epochs and " << trainSecs << " s training\n";
+        finalRMSE = newRMSE;
+        return true;
+      }
+      // ALS improves faster over its first sweeps, it runs them all
+      if(algoParams.training_mode == "als")
+        finalRMSE = newRMSE;
+      else if(diff > olddiff) {
           finalRMSE = newRMSE;
-          break;
+          return true;
       }
       olddiff = diff;
 
       if(newRMSE < oldRMSE) {
-        updateQandP();
+        if(improvedSwap) {
+          std::swap(Pstar, Psnap);
+          std::swap(Qstar, Qsnap);
+        }
+        else
+          updateQandP();
       }
       oldRMSE = newRMSE;
+      return false;
+    };
+
+    // overlapped, epoch n's snapshot is validated on its own thread while
+    // epoch n + 1 trains. Its result is only known after that, when it
+    // stops training the snapshot becomes P, Q again, so the model and
+    // RMSEs are the ones of validating every epoch in turn.
+    thread validator;
+    FLT_T pendingRMSE = 0;
+    double pendingSecs = 0;
+    while(!terminalConditionMet()) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      do_for_each_element_of_T1dash();
+      // for each element (u,i,rui) of T1'
+      double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+      std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+      if(!algoParams.overlap_validation) {
+        FLT_T newRMSE = getRMSEforT2dash(P, Q);
+        validationSecs += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - waitStart).count();
+        if(validated(newRMSE, secs, false))
+          break;
+        continue;
+      }
+
+      if(validator.joinable()) {
+        validator.join();
+        if(validated(pendingRMSE, pendingSecs, true)) {
+          // only the factors are read from here on, P's optimizer state
+          // can go with the snapshot
+          std::swap(P, Psnap);
+          std::swap(Q, Qsnap);
+          validationSecs += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - waitStart).count();
+          break;
+        }
+      }
+      P->copy(Psnap);
+      Q->copy(Qsnap);
+      pendingSecs = secs;
+      validator = thread([this, &pendingRMSE]() {
+        pendingRMSE = getRMSEforT2dash(Psnap, Qsnap);
+      });
+      validationSecs += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - waitStart).count();
+    }
+    if(validator.joinable()) {
+      validator.join();
+      validated(pendingRMSE, pendingSecs, true);
     }
     iterations = count -1;
+    cout << " " << algoParams.training_mode << " order " << algoParams.epoch_order
+      << ": T2' RMSE " << firstRMSE << " after the first epoch, " << lastRMSE
+      << " after " << count << " epochs and " << trainSecs << " s, "
+      << (firstRMSE - lastRMSE) / trainSecs << " RMSE drop per s, "
+      << validationSecs << " s waiting on validation\n";
   }
 
   void startMatrixFactorization(vector<RatingEntry> *T) {
@@ -373,16 +875,26 @@ public:
   MatrixFactorization(MatrixFactorizationParams params) : algoParams(params), MAX_USERS(params.max_row_dim),
     MAX_ITEMS(params.max_col_dim), uidRMap(0), iidRMap(0),
     train_start(-1), train_end(-1), test_start(-1), test_end(-1),
-    P(0), Q(0), Pstar(0), Qstar(0), finalRMSE(99.0),
-    lambda_p(params.learning_rate_p), lambda_q(params.learning_rate_q),
-    eta_p(params.regularization_param_p), eta_q(params.regularization_param_q)
+    P(0), Q(0), Pstar(0), Qstar(0), Psnap(0), Qsnap(0),
+    lambda_p(params.regularization_param_p), lambda_q(params.regularization_param_q),
+    eta_p(params.learning_rate_p), eta_q(params.learning_rate_q),
+    finalRMSE(99.0), numBlocks(1)
   {
     ratingsList = new vector<RatingEntry> ();
+    if(params.optimizer == "adagrad")
+      optimizerKind = OPTIMIZER_ADAGRAD;
+    else if(params.optimizer == "rmsprop")
+      optimizerKind = OPTIMIZER_RMSPROP;
+    else if(params.optimizer == "adam")
+      optimizerKind = OPTIMIZER_ADAM;
+    else
+      optimizerKind = OPTIMIZER_SGD;
   }
 
   ~MatrixFactorization() {
     DELETE_AR(uidRMap); DELETE_AR(iidRMap);
     DELETE(P); DELETE(Q); DELETE(Pstar); DELETE(Qstar);
+    DELETE(Psnap); DELETE(Qsnap);
     DELETE(ratingsList);
   }
 
@@ -396,6 +908,7 @@ public:
     shuffleRatingsListIndexes();
     startMatrixFactorization(ratingsList);
     writePqmatrixOutputFile();
+    writeTestSetEntriesToFile();
 
     return true;
   }
@@ -406,8 +919,32 @@ public:
       STRING_T(algoParams.p_q_matrix_output_file_path + "P_matrix.mtx");
     STRING_T Q_matrixPath =
       STRING_T(algoParams.p_q_matrix_output_file_path + "Q_matrix.mtx");
-    P->writeMtxToFileSystem(P_matrixPath.c_str());
-    Q->writeMtxToFileSystem(Q_matrixPath.c_str());
+    P->writeMtxToFileSystem(P_matrixPath.c_str(), false);
+    Q->writeMtxToFileSystem(Q_matrixPath.c_str(), true); // K x items on disk
+  }
+
+  // T2' with raw ids in the ItemItemLearner test set format (INT_T count,
+  // then user, item, rating INT_T triples), for the predictors' evaluators
+  void writeTestSetEntriesToFile()
+  {
+    STRING_T path(algoParams.p_q_matrix_output_file_path + "testSetRatingsList.RatingEntry");
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp)
+      throw("MatrixFactorization::writeTestSetEntriesToFile !fp");
+
+    vector<RatingEntry> &T = *ratingsList;
+    INT_T numEntries = test_end - test_start;
+    size_t sz = fwrite(&numEntries, sizeof(INT_T), 1, fp);
+    for(INT_T x=test_start; x<test_end; x++) {
+      RatingEntry &re = T[ratingsListShuffle[x]];
+      INT_T entry[3] = { re.user_id, re.item_id, (INT_T) re.rating };
+      sz += fwrite(entry, sizeof(entry), 1, fp);
+    }
+    fclose(fp);
+    if(sz != numEntries + 1)
+      throw("MatrixFactorization::writeTestSetEntriesToFile sz != numEntries + 1");
+    if(algoParams.verbose_mode_level > 0)
+      cout << " wrote " << numEntries << " test set entries to " << path << "\n";
   }
 
   FLT_T getFinalRMSE() { return finalRMSE; }
@@ -10,12 +10,9 @@
 #include "../utils/Utils.hpp"
 #include "../utils/Mtx.hpp"
 #include "../utils/UserItemTableHelper.hpp"
-
-typedef struct USR_RANGE_T{
-  INT_T firstUserIdx;
-  INT_T lastUserIdx;
-  USR_RANGE_T(INT_T f, INT_T l) : firstUserIdx(f), lastUserIdx(l) { }
-} USR_RANGE_T;
+#include "../utils/TopN.hpp"
+#include "../utils/RecoWriter.hpp"
+#include "../utils/RankingEvaluator.hpp"
 
 typedef struct RECO_RANK_T {
   INT_T itemId;
@@ -37,6 +34,12 @@ class HiddenFactorPredictor {
   map < INT_T, INT_T > realUserToCodedUsrMap;
   map < INT_T, INT_T > realItemsToCodedItemMap;
 
+  INT_T codedId(map<INT_T, INT_T> &m, INT_T realId)
+  {
+    map<INT_T, INT_T>::iterator it = m.find(realId);
+    return it == m.end() ? -1 : it->second;
+  }
+
   template<typename T>
   void loadVector(const char *filePath, vector<T>& vT)
   {
@@ -81,15 +84,18 @@ class HiddenFactorPredictor {
   }
 
   public:
-    HiddenFactorPredictor(STRING_T inFPath, INT_T _num_factors) :
+    // loadMode MTX_LOAD_MMAP* maps P and Q read only and shared between
+    // processes instead of reading a private copy
+    HiddenFactorPredictor(STRING_T inFPath, INT_T _num_factors,
+      MTX_LOAD_T loadMode = MTX_LOAD_READ) :
       inputFilesPath(inFPath), num_factors(_num_factors), P(0), Q(0)
     {
       cout << " HiddenFactorPredictor(STRING_T inFPath, INT_T _num_factors) " << endl;
 
       STRING_T Pstr = STRING_T(inputFilesPath+"P_matrix.mtx");
       STRING_T Qstr = STRING_T(inputFilesPath+"Q_matrix.mtx");
-      P = new Mtx(Pstr.c_str());
-      Q = new Mtx(Qstr.c_str());
+      P = new Mtx(Pstr.c_str(), loadMode);
+      Q = new Mtx(Qstr.c_str(), loadMode);
 
       STRING_T itmStr = STRING_T(inputFilesPath+"itm.idx");
       STRING_T usrStr = STRING_T(inputFilesPath+"usr.idx");
@@ -175,39 +181,6 @@ class HiddenFactorPredictor {
       return string(recos.str());
     }
 
-    // recoList contains real item ids
-    void saveRecommendationsToFileSystem(INT_T usr,
-      vector<RECO_RANK_T> &recoList, STRING_T recoDir,
-      INT_T numRecommendationsPerUser)
-    {
-      std::ostringstream ss;
-      ss << userIndex[usr] << "_" << usr << ".reco.txt";
-      STRING_T recoFile(recoDir + string(ss.str()));
-
-      FILE *fp = fopen(recoFile.c_str(), "wb");
-      if(!fp) {
-        cout << " saveRecommendationsToFileSystem Unable to write to file "
-          << recoFile << endl;
-        return;
-      }
-
-      for(INT_T i = 0; i<recoList.size(); i++) {
-        std::ostringstream rs; //reco ostringstream
-        rs << recoList[i].itemId << "\n";
-        STRING_T itm(STRING_T(rs.str()));
-        size_t written = fwrite(itm.c_str(), itm.length(), 1, fp);
-
-        if(written <= 0) {
-          cout << " saveRecommendationsToFileSystem if(written <= 0) for "
-            << recoFile << endl;
-          fclose(fp);
-          return;
-        }
-      }
-
-      fclose(fp);
-    }
-
     void saveRecommendationsToDataBase(INT_T usr, vector<RECO_RANK_T> &recoList)
     {
 
@@ -215,98 +188,115 @@ class HiddenFactorPredictor {
 
     // minimumRecoCutOff == the minimum rating required to recommend
     // no point recommending low rating items
+    // users [userFirst, userLast), threadIndex is also the writer shard
     void generateRecommendationsForUsrRange(INT_T userFirst, INT_T userLast,
-      STRING_T inputFilesDirPath, INT_T numRecommendationsPerUser,
-      INT_T minimumRecoCutOff, UserItemTableHelper &uith, INT_T threadIndex)
+      RecoWriter &writer, INT_T minimumRecoCutOff, UserItemTableHelper &uith,
+      TopNSelector &topN, vector<RECO_RANK_T> &recoList, INT_T threadIndex)
     {
-      cout << " generateRecommendationsForAllUsrRange threadIndex "
-        << threadIndex << " started " << endl;
-      for(INT_T usr = userFirst; usr <= userLast; usr++) {
-
-        vector<RECO_RANK_T> recoList;
-        recoList.clear();
-        INT_T maxRec = numRecommendationsPerUser;
-
+      for(INT_T usr = userFirst; usr < userLast; usr++) {
+        topN.reset();
         for(INT_T item = 0; item < itemIndex.size(); item++) {
           if(uith.hasUserRatedItem(usr, item) == 1)
             continue;
           FLT_T prt = getPredictedRating(usr, item);
-          INT_T realItemId = itemIndex[item];
-          if(prt > minimumRecoCutOff) {
-            recoList.push_back(RECO_RANK_T(realItemId, prt));
-            if(!--maxRec)
-              break;
-          }
+          if(prt > minimumRecoCutOff)
+            topN.offer(item, prt);
+        }
+        topN.getSorted(recoList);
+        for(INT_T i = 0; i < recoList.size(); i++) {
+          recoList[i].itemId = itemIndex[recoList[i].itemId];
         }
 
-        sort(recoList.begin(), recoList.end());
-        reverse(recoList.begin(), recoList.end()); // change to descending
-
-        saveRecommendationsToFileSystem(usr, recoList,
-          STRING_T(inputFilesDirPath+"/recos/"), numRecommendationsPerUser);
+        writer.write(threadIndex, userIndex[usr], usr, recoList);
         saveRecommendationsToDataBase(usr, recoList);
       }
     }
 
+    // numThreads is capped at the hardware threads, they pull chunks of
+    // usersPerChunk users from a shared counter until all users are done
     STRING_T generateRecommendationsForAllUsers(STRING_T inputFilesDirPath,
       STRING_T userItemRatingFile, INT_T numRecommendationsPerUser, FLT_T minimumRecoCutOff,
-        INT_T numThreads /* Ensure numThreads is a prime number like 61, 31 etc */)
+        INT_T numThreads, STRING_T recoOutputFormat = "files" /* or tsv, bin see RecoWriter */,
+        INT_T usersPerChunk = 64)
     {
         cout << "generateRecommendationsForAllUsers ..." << endl;
         INT_T totalUsers = userIndex.size();
-        INT_T usersPerThread = totalUsers/numThreads;
+        INT_T threadCount = poolThreadCount(numThreads);
 
         cout << " userIndex.size() " << totalUsers << endl;
         cout << " itemIndex.size() " << itemIndex.size() << endl;
-        cout << " numThreads " << numThreads
-          << " usersPerThread " << usersPerThread << endl;
-
-        INT_T userFirst = 0;
-        INT_T userLast = 0;
-        vector<USR_RANGE_T> usrRangesList;
-
-        for(int i=0; i<numThreads; i++) {
-          userFirst = i*usersPerThread;
-          userLast = userFirst + usersPerThread - 1;
-
-          usrRangesList.push_back(USR_RANGE_T(userFirst, userLast));
-        }
+        cout << " threads " << threadCount << " users per chunk " << usersPerChunk << endl;
 
-        INT_T veryLastUsr = totalUsers - 1;
-        userLast++;
-
-        if((veryLastUsr - userLast) >= 0) {
-          usrRangesList.push_back(USR_RANGE_T(userLast, veryLastUsr));
-        }
-
-        vector<thread> threadList;
         UserItemTableHelper uith(userItemRatingFile);
-        uith.prepareTable();
-
-        for(int i=0; i<usrRangesList.size(); i++) {
-          USR_RANGE_T &uR = usrRangesList[i];
-          userFirst = uR.firstUserIdx;
-          userLast = uR.lastUserIdx;
-          cout << " thread num " << i << " userFirst " << userFirst
-            << " userLast " << userLast << endl;
-
-          threadList.push_back (
-            thread(
-              &HiddenFactorPredictor::generateRecommendationsForUsrRange,
-              this, userFirst, userLast, inputFilesDirPath,
-              numRecommendationsPerUser, minimumRecoCutOff, std::ref(uith), i
-            )
-          );
-          std::this_thread::sleep_for(std::chrono::milliseconds(2));
-        }
-
-        for(INT_T i=0; i<threadList.size(); i++) {
-          threadList[i].join();
-        }
+        uith.prepareTable(userIndex, itemIndex);
+        RecoWriter writer(inputFilesDirPath + "/recos/", recoOutputFormat, threadCount);
+        vector<TopNSelector> topNs(threadCount, TopNSelector(numRecommendationsPerUser));
+        vector< vector<RECO_RANK_T> > recoLists(threadCount);
+        BatchTimings timings(threadCount);
+
+        parallelForBatches(totalUsers, max(1, usersPerChunk), threadCount,
+          [&](long long first, long long last, INT_T t) {
+            timings.time(t, first, last, [&](long long f, long long l) {
+              generateRecommendationsForUsrRange(f, l, writer, minimumRecoCutOff,
+                uith, topNs[t], recoLists[t], t);
+            });
+          });
+        writer.close();
+        timings.report("generateRecommendationsForAllUsers");
 
         return STRING_T("ALL USERS");
     }
 
+    // precision / recall / NDCG / coverage @N for every N in Ns over the
+    // users of a learner's test set (testSetRatingsList.RatingEntry), held
+    // out ratings >= relevantRating are the relevant items. Items rated in
+    // userItemRatingFile are not recommended unless they are held out.
+    vector<RANK_RESULT_T> evaluateRanking(STRING_T userItemRatingFile,
+      const char *testSetPath, INT_T_VEC Ns, FLT_T relevantRating = 4.0,
+      INT_T numThreads = 0, INT_T sampleUsers = 0)
+    {
+      START_TIME_STAMP("HiddenFactorPredictor::evaluateRanking");
+      vector<TEST_RATING_T> testSet;
+      long long unknown = loadTestSetRatings(testSetPath,
+        [this](INT_T u) { return codedId(realUserToCodedUsrMap, u); },
+        [this](INT_T i) { return codedId(realItemsToCodedItemMap, i); },
+        testSet);
+      cout << " test set " << testSet.size() << " ratings, " << unknown
+        << " with unknown user or item ids dropped\n";
+
+      UserItemTableHelper uith(userItemRatingFile);
+      uith.prepareTable(userIndex, itemIndex);
+      for(long long x = 0; x < testSet.size(); x++)
+        uith.userBst[testSet[x].itm][testSet[x].usr] = 0;
+
+      RELEVANT_ITEMS_T rel;
+      groupRelevantItems(testSet, relevantRating, rel);
+      sampleRelevantUsers(rel, sampleUsers);
+
+      INT_T threadCount = poolThreadCount(numThreads);
+      vector<TopNSelector> topNs(threadCount, TopNSelector(1));
+      vector< vector<RECO_RANK_T> > recoLists(threadCount);
+
+      vector<RANK_RESULT_T> results = ::evaluateRanking(rel, Ns, itemIndex.size(),
+        [&](INT_T usr, INT_T maxN, INT_T t, INT_T_VEC &out) {
+          TopNSelector &topN = topNs[t];
+          topN.reset(maxN);
+          for(INT_T item = 0; item < itemIndex.size(); item++) {
+            if(uith.hasUserRatedItem(usr, item) == 1)
+              continue;
+            topN.offer(item, getPredictedRating(usr, item));
+          }
+          topN.getSorted(recoLists[t]);
+          for(INT_T i = 0; i < recoLists[t].size(); i++)
+            out.push_back(recoLists[t][i].itemId);
+        }, threadCount);
+
+      for(INT_T n = 0; n < results.size(); n++)
+        results[n].print("hidden-factor");
+      END_TIME_STAMP;
+      return results;
+    }
+
     // This has to be real user id not coded id
     STRING_T generateRecommendationsForUser(INT_T realUsrId, INT_T numRecommendations = 5,
                 FLT_T ratingCutoff = 4.0) {
@@ -322,29 +312,24 @@ class HiddenFactorPredictor {
       cout << " reading user item ratings from " << userItemRatingsCSV << endl;
 
       UserItemTableHelper uith(userItemRatingsCSV);
-      uith.prepareTable();
+      uith.prepareTable(userIndex, itemIndex);
 
       INT_T codedUsrId = realUserToCodedUsrMap[realUsrId];
+      TopNSelector topN(numRecommendations);
       vector<RECO_RANK_T> recoList;
-      recoList.clear();
 
       for(int i=0; i<itemIndex.size(); i++) {
         if(uith.hasUserRatedItem(codedUsrId, i) == 1)
           continue;
 
         FLT_T prt = getPredictedRating(codedUsrId, i);
-        INT_T realItemId = itemIndex[i];
-
-        // cout << " user " << realUsrId << " has rated item " << realItemId
-        //   << " predicted rating " << prt << endl;
-        if(prt > ratingCutoff) {
-          recoList.push_back(RECO_RANK_T(realItemId, prt));
-        }
-
+        if(prt > ratingCutoff)
+          topN.offer(i, prt);
+      }
+      topN.getSorted(recoList);
+      for(INT_T i = 0; i < recoList.size(); i++) {
+        recoList[i].itemId = itemIndex[recoList[i].itemId];
       }
-
-      sort(recoList.begin(), recoList.end());
-      reverse(recoList.begin(), recoList.end()); // change to descending
 
       return STRING_T(
         getRecommendationsString(realUsrId, recoList, numRecommendations));
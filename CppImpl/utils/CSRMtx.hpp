@@ -0,0 +1,220 @@
+#ifndef CSRMTX_HPP
+#define CSRMTX_HPP
+
+#include <cstdio>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include "Utils.hpp"
+
+using namespace std;
+
+typedef struct CSR_ENTRY_T {
+  INT_T row;
+  INT_T col;
+  FLT_T val;
+  CSR_ENTRY_T(INT_T r, INT_T c, FLT_T v) : row(r), col(c), val(v) { }
+} CSR_ENTRY_T;
+
+// first value of a CSRMtx file, tells it from other and older files
+#define CSR_FILE_MAGIC 0x3258544d525343LL // "CSRMTX2"
+
+// Sparse matrix in compressed sparse row form, columns are sorted
+// within each row so a single value can be found by binary search.
+class CSRMtx {
+  typedef struct COL_VAL_T {
+    INT_T col;
+    FLT_T val;
+    bool operator<(const COL_VAL_T& another) const { return col < another.col; }
+  } COL_VAL_T;
+
+  // closes the file on every way out of a read or write, throws included
+  typedef struct FILE_CLOSER_T {
+    FILE *fp;
+    FILE_CLOSER_T(FILE *f) : fp(f) { }
+    ~FILE_CLOSER_T() { if(fp) fclose(fp); }
+  } FILE_CLOSER_T;
+
+  template<typename T>
+  void writeVector(FILE *fp, vector<T> &v)
+  {
+    if(v.size() && fwrite(&v[0], sizeof(T), v.size(), fp) != v.size())
+      throw("CSRMtx::writeVector fwrite failed");
+  }
+
+  template<typename T>
+  void readVector(FILE *fp, vector<T> &v, long long n)
+  {
+    v = vector<T>(n);
+    if(n && fread(&v[0], sizeof(T), n, fp) != n)
+      throw("CSRMtx::readVector fread failed");
+  }
+
+public:
+  long long rows, cols;
+  vector<long long> rowStart; // rows + 1 entries
+  vector<INT_T> colIdx;
+  vector<FLT_T> vals;
+  // what the matrix was made from and with, saved in the file header so a
+  // reader can tell whether it is still the matrix it wants
+  vector<double> meta;
+
+  CSRMtx() : rows(0), cols(0), rowStart(1, 0) { }
+
+  // Repeated (row, col) entries keep the value seen last
+  CSRMtx(INT_T r, INT_T c, vector<CSR_ENTRY_T> &entries) : rows(r), cols(c)
+  {
+    rowStart = vector<long long>(rows + 1, 0);
+    for(long long x = 0; x < entries.size(); x++) {
+      rowStart[entries[x].row + 1]++;
+    }
+    for(long long x = 0; x < rows; x++) {
+      rowStart[x + 1] += rowStart[x];
+    }
+
+    vector<COL_VAL_T> cv(entries.size());
+    vector<long long> fill(rowStart.begin(), rowStart.end() - 1);
+    for(long long x = 0; x < entries.size(); x++) {
+      COL_VAL_T &e = cv[fill[entries[x].row]++];
+      e.col = entries[x].col;
+      e.val = entries[x].val;
+    }
+
+    colIdx.reserve(cv.size());
+    vals.reserve(cv.size());
+    long long out = 0;
+    for(long long row = 0; row < rows; row++) {
+      long long b = rowStart[row], e = rowStart[row + 1];
+      stable_sort(cv.begin() + b, cv.begin() + e);
+      rowStart[row] = out;
+      for(long long x = b; x < e; x++) {
+        if(x + 1 < e && cv[x + 1].col == cv[x].col)
+          continue;
+        colIdx.push_back(cv[x].col);
+        vals.push_back(cv[x].val);
+        out++;
+      }
+    }
+    rowStart[rows] = out;
+  }
+
+  CSRMtx(const char *filePath) : rows(0), cols(0)
+  {
+    readFromFileSystem(filePath);
+  }
+
+  long long nnz() const { return colIdx.size(); }
+
+  INT_T rowSize(INT_T r) const { return rowStart[r + 1] - rowStart[r]; }
+  const INT_T* rowCols(INT_T r) const { return colIdx.data() + rowStart[r]; }
+  const FLT_T* rowVals(INT_T r) const { return vals.data() + rowStart[r]; }
+  FLT_T* rowVals(INT_T r) { return vals.data() + rowStart[r]; }
+
+  // index of (r, c) in colIdx / vals or -1 when absent
+  long long find(INT_T r, INT_T c) const
+  {
+    const INT_T *b = colIdx.data() + rowStart[r];
+    const INT_T *e = colIdx.data() + rowStart[r + 1];
+    const INT_T *it = lower_bound(b, e, c);
+    if(it == e || *it != c)
+      return -1;
+    return it - colIdx.data();
+  }
+
+  FLT_T get(INT_T r, INT_T c, FLT_T missing) const
+  {
+    long long x = find(r, c);
+    return x < 0 ? missing : vals[x];
+  }
+
+  void transpose(CSRMtx &t) const
+  {
+    t.rows = cols;
+    t.cols = rows;
+    t.rowStart = vector<long long>(cols + 1, 0);
+    t.colIdx = vector<INT_T>(nnz());
+    t.vals = vector<FLT_T>(nnz());
+
+    for(long long x = 0; x < nnz(); x++) {
+      t.rowStart[colIdx[x] + 1]++;
+    }
+    for(long long x = 0; x < cols; x++) {
+      t.rowStart[x + 1] += t.rowStart[x];
+    }
+    // rows are visited in order so the transposed rows come out sorted
+    vector<long long> fill(t.rowStart.begin(), t.rowStart.end() - 1);
+    for(INT_T r = 0; r < rows; r++) {
+      for(long long x = rowStart[r]; x < rowStart[r + 1]; x++) {
+        long long dst = fill[colIdx[x]]++;
+        t.colIdx[dst] = r;
+        t.vals[dst] = vals[x];
+      }
+    }
+  }
+
+  void writeToFileSystem(const char *filePath)
+  {
+    FILE *fp = fopen(filePath, "wb");
+    if(!fp)
+      throw("CSRMtx::writeToFileSystem if(!fp)");
+    FILE_CLOSER_T closer(fp);
+
+    long long magic = CSR_FILE_MAGIC, n = nnz(), numMeta = meta.size();
+    if(fwrite(&magic, sizeof(magic), 1, fp) + fwrite(&rows, sizeof(rows), 1, fp)
+      + fwrite(&cols, sizeof(cols), 1, fp) + fwrite(&n, sizeof(n), 1, fp)
+      + fwrite(&numMeta, sizeof(numMeta), 1, fp) != 5)
+      throw("CSRMtx::writeToFileSystem header");
+    writeVector(fp, meta);
+    writeVector(fp, rowStart);
+    writeVector(fp, colIdx);
+    writeVector(fp, vals);
+  }
+
+  // Sizes in the header are checked against the file size before anything
+  // is allocated, a corrupt or truncated file throws a const char * like
+  // every other read error instead of running into bad_alloc
+  void readFromFileSystem(const char *filePath)
+  {
+    FILE *fp = fopen(filePath, "rb");
+    if(!fp)
+      throw("CSRMtx::readFromFileSystem if(!fp)");
+    FILE_CLOSER_T closer(fp);
+
+    long long fileSize = -1;
+    if(fseek(fp, 0, SEEK_END) == 0)
+      fileSize = ftell(fp);
+    if(fileSize < 0 || fseek(fp, 0, SEEK_SET) != 0)
+      throw("CSRMtx::readFromFileSystem cannot size the file");
+
+    long long magic = 0, n = 0, numMeta = 0;
+    if(fread(&magic, sizeof(magic), 1, fp) != 1 || magic != CSR_FILE_MAGIC)
+      throw("CSRMtx::readFromFileSystem not a CSRMtx file, or saved by an older version");
+    if(fread(&rows, sizeof(rows), 1, fp) + fread(&cols, sizeof(cols), 1, fp)
+      + fread(&n, sizeof(n), 1, fp) + fread(&numMeta, sizeof(numMeta), 1, fp) != 4)
+      throw("CSRMtx::readFromFileSystem header");
+
+    // each count bounded by the body first, so the sum cannot overflow
+    long long body = fileSize - 5 * (long long) sizeof(long long);
+    if(rows < 0 || rows >= INT_MAX || cols < 0 || cols > INT_MAX || n < 0 || numMeta < 0
+      || numMeta > body / (long long) sizeof(double)
+      || rows + 1 > body / (long long) sizeof(long long)
+      || n > body / (long long) (sizeof(INT_T) + sizeof(FLT_T))
+      || numMeta * (long long) sizeof(double) + (rows + 1) * (long long) sizeof(long long)
+        + n * (long long) (sizeof(INT_T) + sizeof(FLT_T)) != body)
+      throw("CSRMtx::readFromFileSystem header does not match the file size");
+
+    readVector(fp, meta, numMeta);
+    readVector(fp, rowStart, rows + 1);
+    readVector(fp, colIdx, n);
+    readVector(fp, vals, n);
+
+    if(rowStart[0] != 0 || rowStart[rows] != n)
+      throw("CSRMtx::readFromFileSystem row offsets do not match the entries");
+    for(long long r = 0; r < rows; r++) {
+      if(rowStart[r] > rowStart[r + 1])
+        throw("CSRMtx::readFromFileSystem row offsets do not match the entries");
+    }
+  }
+};
+
+#endif // CSRMTX_HPP
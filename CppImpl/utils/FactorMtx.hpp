@@ -0,0 +1,191 @@
+#ifndef FACTORMTX_HPP
+#define FACTORMTX_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include "Utils.hpp"
+#include "Mtx.hpp"
+
+using namespace std;
+
+// floats per SIMD register (AVX), factor rows are padded to a multiple
+#define FACTOR_LANES 8
+#define FACTOR_ALIGN 64
+
+// Latent factors, one row of K values per user or item. Rows are padded
+// with zeros to a multiple of FACTOR_LANES and start on FACTOR_ALIGN
+// byte boundaries, so a row is contiguous and whole SIMD loads never
+// straddle rows. The padding stays zero under the SGD step (0 + eta *
+// (e * 0 - lambda * 0)) and does not change dot products.
+//
+// A row can carry per row state after its factors, so one row fetch
+// brings in all an update needs: slots - 1 more stride long vectors (e.g.
+// optimizer moments, slot(r, s)) and tailSize more values (tail(r)), all
+// zero to start with.
+class FactorMtx {
+  FLT_T *dat;
+
+public:
+  long long rows;
+  INT_T K, stride;
+  INT_T slots, rowStride;
+
+  FactorMtx(long long r, INT_T k, FLT_T initVal, INT_T numSlots = 1, INT_T tailSize = 0) :
+    dat(0), rows(r), K(k),
+    stride((k + FACTOR_LANES - 1) / FACTOR_LANES * FACTOR_LANES), slots(numSlots),
+    rowStride(numSlots * stride + (tailSize + FACTOR_LANES - 1) / FACTOR_LANES * FACTOR_LANES)
+  {
+    size_t sz = sizeof(FLT_T) * rows * rowStride;
+    if(posix_memalign((void **) &dat, FACTOR_ALIGN, max((size_t) FACTOR_ALIGN, sz)))
+      throw("FactorMtx posix_memalign failed");
+    memset(dat, 0, sz);
+    for(long long x = 0; x < rows; x++) {
+      for(INT_T c = 0; c < K; c++)
+        row(x)[c] = initVal;
+    }
+  }
+
+  ~FactorMtx() {
+    if(dat) {
+      free(dat);
+      dat = 0;
+    }
+  }
+
+  FLT_T *row(long long r) { return dat + r * rowStride; }
+  const FLT_T *row(long long r) const { return dat + r * rowStride; }
+  FLT_T *slot(long long r, INT_T s) { return row(r) + s * stride; }
+  FLT_T *tail(long long r) { return row(r) + slots * stride; }
+  FLT_T get(long long r, INT_T k) const { return row(r)[k]; }
+  void set(long long r, INT_T k, FLT_T v) { row(r)[k] = v; }
+
+  // asks for row r's cache lines, its state included, ahead of its use
+  void prefetchRow(long long r) const {
+    const char *p = (const char *) row(r);
+    for(size_t off = 0; off < sizeof(FLT_T) * rowStride; off += FACTOR_ALIGN)
+      __builtin_prefetch(p + off, 1);
+  }
+
+  // the factors into dst, which may carry other row state
+  void copy(FactorMtx *dst) const {
+    if(dst->rowStride == rowStride) {
+      memcpy(dst->dat, dat, sizeof(FLT_T) * rows * rowStride);
+      return;
+    }
+    for(long long x = 0; x < rows; x++)
+      memcpy(dst->row(x), row(x), sizeof(FLT_T) * stride);
+  }
+
+  // On disk as an Mtx, rows x K, or K x rows with transposed (the Q
+  // layout the predictors read)
+  void writeMtxToFileSystem(const char *filePath, bool transposed) const {
+    Mtx m(transposed ? K : rows, transposed ? rows : K);
+    for(long long x = 0; x < rows; x++) {
+      for(INT_T k = 0; k < K; k++) {
+        if(transposed)
+          m.set(k, x, get(x, k));
+        else
+          m.set(x, k, get(x, k));
+      }
+    }
+    m.writeMtxToFileSystem(filePath);
+  }
+};
+
+// p . q over K factors, K a multiple of FACTOR_LANES. The lanes are summed
+// separately and added at the end so the loop maps onto SIMD registers.
+template<INT_T K>
+inline FLT_T factorDot(const FLT_T *p, const FLT_T *q)
+{
+  FLT_T acc[FACTOR_LANES] = { 0 };
+  for(INT_T k = 0; k < K; k += FACTOR_LANES) {
+    for(INT_T l = 0; l < FACTOR_LANES; l++)
+      acc[l] += p[k + l] * q[k + l];
+  }
+  FLT_T sum = 0;
+  for(INT_T l = 0; l < FACTOR_LANES; l++)
+    sum += acc[l];
+  return sum;
+}
+
+// any padded stride
+inline FLT_T factorDot(const FLT_T *p, const FLT_T *q, INT_T stride)
+{
+  FLT_T acc[FACTOR_LANES] = { 0 };
+  for(INT_T k = 0; k < stride; k += FACTOR_LANES) {
+    for(INT_T l = 0; l < FACTOR_LANES; l++)
+      acc[l] += p[k + l] * q[k + l];
+  }
+  FLT_T sum = 0;
+  for(INT_T l = 0; l < FACTOR_LANES; l++)
+    sum += acc[l];
+  return sum;
+}
+
+// One fused SGD step on r_ui: the prediction, its error and the
+// simultaneous update of p_u and q_i in a single pass over the rows.
+template<INT_T K>
+inline void factorSgdStep(FLT_T *p, FLT_T *q, FLT_T rui,
+  FLT_T eta_p, FLT_T eta_q, FLT_T lambda_p, FLT_T lambda_q)
+{
+  FLT_T e = rui - factorDot<K>(p, q);
+  for(INT_T k = 0; k < K; k++) {
+    FLT_T pk = p[k], qk = q[k];
+    p[k] = pk + eta_p * ((e * qk) - (lambda_p * pk));
+    q[k] = qk + eta_q * ((e * pk) - (lambda_q * qk));
+  }
+}
+
+inline void factorSgdStep(FLT_T *p, FLT_T *q, FLT_T rui, INT_T stride,
+  FLT_T eta_p, FLT_T eta_q, FLT_T lambda_p, FLT_T lambda_q)
+{
+  FLT_T e = rui - factorDot(p, q, stride);
+  for(INT_T k = 0; k < stride; k++) {
+    FLT_T pk = p[k], qk = q[k];
+    p[k] = pk + eta_p * ((e * qk) - (lambda_p * pk));
+    q[k] = qk + eta_q * ((e * pk) - (lambda_q * qk));
+  }
+}
+
+// Per parameter step sizes for the SGD step, the state is kept in the
+// slots of the P and Q rows it belongs to
+enum { OPTIMIZER_SGD, OPTIMIZER_ADAGRAD, OPTIMIZER_RMSPROP, OPTIMIZER_ADAM };
+
+// The step of factorSgdStep with each parameter's d = e * q - lambda * p
+// scaled by its own running size: v (the second moment slots vp, vq) sums
+// d * d for AdaGrad and averages it with beta2 for RMSProp and Adam, and
+// Adam also moves along m (mp, mq), the beta1 average of d. Adam's bias
+// correction is folded into eta_p / eta_q by the caller. n is the padded
+// stride, padding stays zero as d is zero there. The six vectors never
+// overlap, without saying so the compiler does not vectorize the loop.
+template<INT_T KIND>
+inline void factorAdaptiveStep(FLT_T *__restrict__ p, FLT_T *__restrict__ q,
+  FLT_T *__restrict__ vp, FLT_T *__restrict__ vq,
+  FLT_T *__restrict__ mp, FLT_T *__restrict__ mq, FLT_T rui, INT_T n, FLT_T eta_p, FLT_T eta_q,
+  FLT_T lambda_p, FLT_T lambda_q, FLT_T beta1, FLT_T beta2, FLT_T epsilon)
+{
+  FLT_T e = rui - factorDot(p, q, n);
+  for(INT_T k = 0; k < n; k++) {
+    FLT_T pk = p[k], qk = q[k];
+    FLT_T dp = (e * qk) - (lambda_p * pk), dq = (e * pk) - (lambda_q * qk);
+    if(KIND == OPTIMIZER_ADAGRAD) {
+      vp[k] += dp * dp;
+      vq[k] += dq * dq;
+    }
+    else {
+      vp[k] = beta2 * vp[k] + (1 - beta2) * dp * dp;
+      vq[k] = beta2 * vq[k] + (1 - beta2) * dq * dq;
+    }
+    if(KIND == OPTIMIZER_ADAM) {
+      mp[k] = beta1 * mp[k] + (1 - beta1) * dp;
+      mq[k] = beta1 * mq[k] + (1 - beta1) * dq;
+      dp = mp[k];
+      dq = mq[k];
+    }
+    p[k] = pk + eta_p * dp / (sqrt(vp[k]) + epsilon);
+    q[k] = qk + eta_q * dq / (sqrt(vq[k]) + epsilon);
+  }
+}
+
+#endif // FACTORMTX_HPP
@@ -0,0 +1,48 @@
+#ifndef IDRELABELER_HPP
+#define IDRELABELER_HPP
+
+#include <vector>
+#include <algorithm>
+#include "Utils.hpp"
+
+using namespace std;
+
+// Coded ids index every per user / per item array (bitsets, quick rating
+// arrays, factor rows, similarity rows). Giving the most active users and
+// the most popular items the smallest coded ids packs the hot rows together
+// and keeps per item arrays sized by the largest coded user id short.
+//
+// indexTable maps coded id -> raw id and counts is indexed by coded id.
+// Both are reordered by descending count (ties keep their order), the
+// returned vector maps old coded id -> new coded id.
+inline vector<INT_T> relabelByCount(vector<INT_T> &indexTable,
+  vector<long long> &counts)
+{
+  INT_T n = indexTable.size();
+  vector<INT_T> order(n);
+  for(INT_T i = 0; i < n; i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [&counts](INT_T a, INT_T b) {
+    return counts[a] > counts[b];
+  });
+
+  vector<INT_T> newTable(n), oldToNew(n);
+  vector<long long> newCounts(n);
+  for(INT_T k = 0; k < n; k++) {
+    newTable[k] = indexTable[order[k]];
+    newCounts[k] = counts[order[k]];
+    oldToNew[order[k]] = k;
+  }
+  indexTable.swap(newTable);
+  counts.swap(newCounts);
+  return oldToNew;
+}
+
+// Rewrites a raw id -> coded id array after relabelByCount
+inline void updateReverseMap(const vector<INT_T> &indexTable, INT_T *rmap)
+{
+  for(INT_T k = 0; k < indexTable.size(); k++)
+    rmap[indexTable[k]] = k;
+}
+
+#endif // IDRELABELER_HPP
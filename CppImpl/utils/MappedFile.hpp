@@ -0,0 +1,81 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Utils.hpp"
+
+using namespace std;
+
+// How Mtx / TriMtx files are brought into memory
+//  read           malloc + fread, a private copy (the default)
+//  mmap           read only MAP_SHARED mapping, pages come in on first
+//                 touch and are shared with every process mapping the file
+//  mmap-populate  mmap with MAP_POPULATE, the whole file is read in up front
+//  mmap-willneed  mmap + madvise(MADV_WILLNEED), read ahead in background
+enum MTX_LOAD_T {
+  MTX_LOAD_READ,
+  MTX_LOAD_MMAP,
+  MTX_LOAD_MMAP_POPULATE,
+  MTX_LOAD_MMAP_WILLNEED
+};
+
+inline MTX_LOAD_T parseMtxLoadMode(const STRING_T &s)
+{
+  if(s == "read")
+    return MTX_LOAD_READ;
+  if(s == "mmap")
+    return MTX_LOAD_MMAP;
+  if(s == "mmap-populate")
+    return MTX_LOAD_MMAP_POPULATE;
+  if(s == "mmap-willneed")
+    return MTX_LOAD_MMAP_WILLNEED;
+  throw("parseMtxLoadMode use read, mmap, mmap-populate or mmap-willneed");
+}
+
+// Read only mapping of a whole file, unmapped on destruction
+class MappedFile {
+  void *addr;
+  size_t len;
+
+public:
+  MappedFile(const char *filePath, MTX_LOAD_T mode) : addr(0), len(0)
+  {
+    int fd = open(filePath, O_RDONLY);
+    if(fd < 0)
+      throw("MappedFile open failed");
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+      close(fd);
+      throw("MappedFile fstat failed or empty file");
+    }
+    len = st.st_size;
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if(mode == MTX_LOAD_MMAP_POPULATE)
+      flags |= MAP_POPULATE;
+#endif
+    addr = mmap(0, len, PROT_READ, flags, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+      addr = 0;
+      throw("MappedFile mmap failed");
+    }
+    if(mode == MTX_LOAD_MMAP_WILLNEED)
+      madvise(addr, len, MADV_WILLNEED);
+  }
+
+  ~MappedFile()
+  {
+    if(addr)
+      munmap(addr, len);
+  }
+
+  const char * data() const { return (const char *) addr; }
+  size_t size() const { return len; }
+};
+
+#endif // MAPPEDFILE_HPP
@@ -7,6 +7,7 @@
 #include <string>
 #include <iostream>
 #include "Utils.hpp"
+#include "MappedFile.hpp"
 
 using namespace std;
 
@@ -15,6 +16,7 @@ private:
   //long long rows, cols;
   FLT_T * dat;
   size_t mtxDataSz;
+  MappedFile *mapped; // dat points into it, read only, when not 0
 
 
   FLT_T * allocateMem() {
@@ -28,10 +30,10 @@ private:
 
 public:
   long long rows, cols;
-  Mtx(INT_T r, INT_T c) : rows(r), cols(c), dat(0) {
+  Mtx(INT_T r, INT_T c) : rows(r), cols(c), dat(0), mapped(0) {
     dat = allocateMem();
   }
-  Mtx(INT_T r, INT_T c, FLT_T initVal) : rows(r), cols(c), dat(0) {
+  Mtx(INT_T r, INT_T c, FLT_T initVal) : rows(r), cols(c), dat(0), mapped(0) {
     dat = allocateMem();
     for(INT_T r=0; r<rows; r++) {
       for(INT_T c=0; c<cols; c++) {
@@ -39,9 +41,21 @@ public:
       }
     }
   }
-  Mtx(const char* filePath): rows(0), cols(0), dat(0){ readMtxFromFileSystem(filePath); }
+  Mtx(const char* filePath): rows(0), cols(0), dat(0), mapped(0) { readMtxFromFileSystem(filePath); }
+  // mmap modes give a read only matrix, set() must not be used on it
+  Mtx(const char* filePath, MTX_LOAD_T mode): rows(0), cols(0), dat(0), mapped(0) {
+    if(mode == MTX_LOAD_READ)
+      readMtxFromFileSystem(filePath);
+    else
+      mapMtxFromFileSystem(filePath, mode);
+  }
   ~Mtx() {
     // cout << "~Mtx\n";
+    if(mapped) {
+      delete mapped;
+      mapped = 0;
+      dat = 0;
+    }
     if(dat) {
       //cout << "~Mtx free("<< dat <<")\n";
       free(dat);
@@ -122,11 +136,30 @@ public:
       throw("Mtx::readMtxFromFileSystem if(!dat)");
 
     size_t mtxSz = fread(dat, mtxDataSz, 1, fp);
+    fclose(fp);
     //cout << " mtxSz " << mtxSz << "\n";
     if(mtxSz!= 1)
       throw("Mtx::readMtxFromFileSystem");
   }
 
+  void mapMtxFromFileSystem(const char* filePath, MTX_LOAD_T mode)
+  {
+    mapped = new MappedFile(filePath, mode);
+    const long long *hdr = (const long long *) mapped->data();
+    if(mapped->size() < 2 * sizeof(long long))
+      throw("Mtx::mapMtxFromFileSystem file too small");
+    rows = hdr[0];
+    cols = hdr[1];
+    if(rows <= 0 || cols <= 0)
+      throw("Mtx::mapMtxFromFileSystem if(rows <= 0 || cols <= 0)");
+    mtxDataSz = sizeof(FLT_T) * rows * cols;
+    if(mapped->size() < 2 * sizeof(long long) + mtxDataSz)
+      throw("Mtx::mapMtxFromFileSystem file shorter than rows * cols");
+    dat = (FLT_T *) (mapped->data() + 2 * sizeof(long long));
+  }
+
+  bool isMapped() const { return mapped != 0; }
+
   bool compare(const Mtx &m2) const
   {
     const Mtx &m1 = *this;
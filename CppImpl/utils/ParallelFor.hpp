@@ -0,0 +1,119 @@
+#ifndef PARALLELFOR_HPP
+#define PARALLELFOR_HPP
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include "Utils.hpp"
+
+using namespace std;
+
+// threadCount <= 0 means one thread per hardware thread
+inline INT_T resolveThreadCount(INT_T threadCount)
+{
+  if(threadCount > 0)
+    return threadCount;
+  return max(1, (INT_T) thread::hardware_concurrency());
+}
+
+// threads for CPU bound work, more than the hardware runs at once only
+// adds switching
+inline INT_T poolThreadCount(INT_T threadCount)
+{
+  return min(resolveThreadCount(threadCount), resolveThreadCount(0));
+}
+
+// Runs fn(first, last, threadIndex) on [first, last) batches of [0, n).
+// Threads pull the next batch from an atomic counter so uneven batches
+// even out, each thread index is owned by one thread for per thread state.
+template<typename FN>
+void parallelForBatches(long long n, long long batchSize, INT_T threadCount, FN fn)
+{
+  threadCount = resolveThreadCount(threadCount);
+  batchSize = max(1LL, batchSize);
+  long long numBatches = (n + batchSize - 1) / batchSize;
+  threadCount = (INT_T) min((long long) threadCount, max(1LL, numBatches));
+
+  std::atomic<long long> nextBatch(0);
+  auto worker = [&](INT_T threadIndex) {
+    for(long long b = nextBatch++; b < numBatches; b = nextBatch++) {
+      long long first = b * batchSize;
+      fn(first, min(n, first + batchSize), threadIndex);
+    }
+  };
+
+  vector<thread> threadList;
+  for(INT_T i=1; i<threadCount; i++) {
+    threadList.push_back(thread(worker, i));
+  }
+  worker(0);
+  for(INT_T i=0; i<threadList.size(); i++) {
+    threadList[i].join();
+  }
+}
+
+// Wall time of every batch of a parallelForBatches run, recorded by the
+// thread that ran it into its own slot. report() shows the spread of the
+// batch times and of the threads' busy times, stragglers stand out there.
+class BatchTimings {
+  typedef struct THREAD_TIMES_T {
+    vector<double> batchMs;
+    double busyMs, longestMs;
+    long long longestFirst, longestLast;
+    THREAD_TIMES_T() : busyMs(0), longestMs(-1), longestFirst(0), longestLast(0) { }
+  } THREAD_TIMES_T;
+
+  vector<THREAD_TIMES_T> threads;
+
+public:
+  BatchTimings(INT_T threadCount) : threads(threadCount) { }
+
+  // runs fn(first, last) and records its time, only threadIndex's owner
+  template<typename FN>
+  void time(INT_T threadIndex, long long first, long long last, FN fn)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fn(first, last);
+    double ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+
+    THREAD_TIMES_T &t = threads[threadIndex];
+    if(ms > t.longestMs) {
+      t.longestMs = ms;
+      t.longestFirst = first;
+      t.longestLast = last;
+    }
+    t.batchMs.push_back(ms);
+    t.busyMs += ms;
+  }
+
+  void report(const char *tag)
+  {
+    vector<double> all;
+    double minBusy = -1, maxBusy = 0;
+    INT_T longest = 0;
+    for(INT_T i = 0; i < threads.size(); i++) {
+      THREAD_TIMES_T &t = threads[i];
+      all.insert(all.end(), t.batchMs.begin(), t.batchMs.end());
+      if(minBusy < 0 || t.busyMs < minBusy)
+        minBusy = t.busyMs;
+      maxBusy = max(maxBusy, t.busyMs);
+      if(t.longestMs > threads[longest].longestMs)
+        longest = i;
+    }
+    if(all.empty())
+      return;
+    sort(all.begin(), all.end());
+    cout << " " << tag << " " << all.size() << " batches on " << threads.size()
+      << " threads, batch ms min " << all[0]
+      << " median " << all[all.size() / 2]
+      << " p99 " << all[(all.size() - 1) * 99 / 100]
+      << " max " << all.back() << " ([" << threads[longest].longestFirst
+      << ", " << threads[longest].longestLast << "))"
+      << ", thread busy ms min " << minBusy << " max " << maxBusy << "\n";
+  }
+};
+
+#endif // PARALLELFOR_HPP
@@ -0,0 +1,197 @@
+#ifndef RANKINGEVALUATOR_HPP
+#define RANKINGEVALUATOR_HPP
+
+#include <cmath>
+#include <climits>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "Utils.hpp"
+#include "ParallelFor.hpp"
+#include "RatingEvaluator.hpp"
+
+using namespace std;
+
+// Held out items a user rated at least the relevance threshold, coded ids,
+// CSR style: user x owns items[start[x] .. start[x+1]) sorted by item
+typedef struct RELEVANT_ITEMS_T {
+  INT_T_VEC users;
+  vector<long long> start;
+  INT_T_VEC items;
+
+  INT_T size() const { return users.size(); }
+  long long count(INT_T x) const { return start[x+1] - start[x]; }
+  bool has(INT_T x, INT_T itm) const
+  {
+    return binary_search(items.begin() + start[x], items.begin() + start[x+1], itm);
+  }
+} RELEVANT_ITEMS_T;
+
+typedef struct RANK_RESULT_T {
+  INT_T N;
+  long long users;  // users with at least one relevant held out item
+  double precision; // averaged over users, hits / N
+  double recall;    // averaged over users, hits / relevant items
+  double ndcg;      // binary relevance, averaged over users
+  double coverage;  // distinct items recommended in any top N / all items
+  RANK_RESULT_T(INT_T n) : N(n), users(0), precision(0), recall(0), ndcg(0), coverage(0) { }
+
+  void print(const char *tag) const
+  {
+    cout << " " << tag << " @" << N << " precision " << precision
+      << " recall " << recall << " ndcg " << ndcg << " coverage " << coverage
+      << " over " << users << " users\n";
+  }
+} RANK_RESULT_T;
+
+// testSet grouped by user (loadTestSetRatings order), users without a
+// rating >= minRelevantRating are left out
+inline void groupRelevantItems(const vector<TEST_RATING_T> &testSet,
+  FLT_T minRelevantRating, RELEVANT_ITEMS_T &rel)
+{
+  rel.users.clear();
+  rel.items.clear();
+  rel.start.assign(1, 0);
+  for(long long x = 0; x < testSet.size(); x++) {
+    const TEST_RATING_T &tr = testSet[x];
+    if(tr.rating < minRelevantRating)
+      continue;
+    if(rel.users.empty() || rel.users.back() != tr.usr) {
+      rel.users.push_back(tr.usr);
+      rel.start.push_back(rel.items.size());
+    }
+    rel.items.push_back(tr.itm);
+    rel.start.back() = rel.items.size();
+  }
+}
+
+// Keeps numUsers of rel picked at random (seeded, so runs are repeatable),
+// still in user order
+inline void sampleRelevantUsers(RELEVANT_ITEMS_T &rel, INT_T numUsers,
+  unsigned seed = 1)
+{
+  if(numUsers <= 0 || numUsers >= rel.size())
+    return;
+  INT_T_VEC pick(rel.size());
+  for(INT_T x = 0; x < pick.size(); x++)
+    pick[x] = x;
+  std::mt19937 gen(seed);
+  shuffle(pick.begin(), pick.end(), gen);
+  pick.resize(numUsers);
+  sort(pick.begin(), pick.end());
+
+  RELEVANT_ITEMS_T s;
+  s.start.assign(1, 0);
+  for(INT_T p = 0; p < pick.size(); p++) {
+    INT_T x = pick[p];
+    s.users.push_back(rel.users[x]);
+    s.items.insert(s.items.end(), rel.items.begin() + rel.start[x],
+      rel.items.begin() + rel.start[x+1]);
+    s.start.push_back(s.items.size());
+  }
+  std::swap(rel, s);
+}
+
+// precision@N, recall@N, NDCG@N and catalog coverage@N for every N in Ns,
+// one top max(Ns) list per user. recommend(usr, maxN, threadIndex, out)
+// fills out with coded item ids best first, excluding items the user rated
+// outside the test set; threadIndex < threadCount selects the caller's
+// per thread scratch. Each thread sums into its own accumulators, the
+// coverage of all N comes from the best rank each item was recommended at.
+template<typename RECOMMEND_FN>
+vector<RANK_RESULT_T> evaluateRanking(const RELEVANT_ITEMS_T &rel,
+  INT_T_VEC Ns, INT_T numItems, RECOMMEND_FN recommend, INT_T threadCount,
+  long long batchSize = 64)
+{
+  typedef struct PARTIAL_T {
+    vector<double> precision, recall, ndcg;
+    INT_T_VEC bestRank; // per item, INT_MAX if never recommended
+    long long users;
+  } PARTIAL_T;
+
+  sort(Ns.begin(), Ns.end());
+  Ns.erase(unique(Ns.begin(), Ns.end()), Ns.end());
+  while(Ns.size() && Ns[0] <= 0)
+    Ns.erase(Ns.begin());
+  vector<RANK_RESULT_T> results;
+  if(Ns.empty())
+    return results;
+  INT_T maxN = Ns.back();
+
+  vector<double> discount(maxN); // 1 / log2(rank + 2)
+  for(INT_T r = 0; r < maxN; r++)
+    discount[r] = 1.0 / log2(r + 2.0);
+
+  threadCount = resolveThreadCount(threadCount);
+  vector<PARTIAL_T> partial(threadCount);
+  for(INT_T t = 0; t < threadCount; t++) {
+    partial[t].precision.assign(Ns.size(), 0);
+    partial[t].recall.assign(Ns.size(), 0);
+    partial[t].ndcg.assign(Ns.size(), 0);
+    partial[t].users = 0;
+  }
+
+  parallelForBatches(rel.size(), batchSize, threadCount,
+    [&](long long first, long long last, INT_T t) {
+      PARTIAL_T &p = partial[t];
+      if(p.bestRank.empty())
+        p.bestRank.assign(numItems, INT_MAX);
+      INT_T_VEC recoList;
+      for(long long x = first; x < last; x++) {
+        recoList.clear();
+        recommend(rel.users[x], maxN, t, recoList);
+
+        long long numRelevant = rel.count(x);
+        double hits = 0, dcg = 0, idcg = 0;
+        INT_T r = 0;
+        for(INT_T n = 0; n < Ns.size(); n++) {
+          for(; r < Ns[n]; r++) {
+            if(r < numRelevant)
+              idcg += discount[r];
+            if(r >= recoList.size())
+              continue;
+            INT_T itm = recoList[r];
+            p.bestRank[itm] = min(p.bestRank[itm], r);
+            if(rel.has(x, itm)) {
+              hits++;
+              dcg += discount[r];
+            }
+          }
+          p.precision[n] += hits / Ns[n];
+          p.recall[n] += hits / numRelevant;
+          p.ndcg[n] += dcg / idcg;
+        }
+        p.users++;
+      }
+    });
+
+  long long users = 0;
+  INT_T_VEC bestRank(numItems, INT_MAX);
+  for(INT_T t = 0; t < threadCount; t++) {
+    users += partial[t].users;
+    for(INT_T i = 0; i < partial[t].bestRank.size(); i++)
+      bestRank[i] = min(bestRank[i], partial[t].bestRank[i]);
+  }
+  for(INT_T n = 0; n < Ns.size(); n++) {
+    RANK_RESULT_T res(Ns[n]);
+    res.users = users;
+    for(INT_T t = 0; t < threadCount; t++) {
+      res.precision += partial[t].precision[n];
+      res.recall += partial[t].recall[n];
+      res.ndcg += partial[t].ndcg[n];
+    }
+    if(users) {
+      res.precision /= users;
+      res.recall /= users;
+      res.ndcg /= users;
+    }
+    long long covered = 0;
+    for(INT_T i = 0; i < numItems; i++)
+      covered += bestRank[i] < Ns[n];
+    res.coverage = numItems ? (double) covered / numItems : 0;
+    results.push_back(res);
+  }
+  return results;
+}
+
+#endif // RANKINGEVALUATOR_HPP
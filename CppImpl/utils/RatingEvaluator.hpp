@@ -0,0 +1,137 @@
+#ifndef RATINGEVALUATOR_HPP
+#define RATINGEVALUATOR_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "Utils.hpp"
+#include "ParallelFor.hpp"
+
+using namespace std;
+
+// A held out rating with coded ids
+typedef struct TEST_RATING_T {
+  INT_T usr;
+  INT_T itm;
+  FLT_T rating;
+  TEST_RATING_T(INT_T u, INT_T i, FLT_T r) : usr(u), itm(i), rating(r) { }
+  bool operator<(const TEST_RATING_T& another) const
+  {
+    return usr < another.usr || (usr == another.usr && itm < another.itm);
+  }
+} TEST_RATING_T;
+
+typedef struct EVAL_RESULT_T {
+  long long count;   // ratings predicted
+  long long skipped; // no prediction possible (NAN)
+  double rmse;
+  double mae;
+  EVAL_RESULT_T() : count(0), skipped(0), rmse(NAN), mae(NAN) { }
+
+  void print(const char *tag) const
+  {
+    cout << " " << tag << " rmse " << rmse << " mae " << mae
+      << " over " << count << " ratings, " << skipped << " without prediction\n";
+  }
+} EVAL_RESULT_T;
+
+// Reads the test set the learners write (testSetRatingsList.RatingEntry):
+// INT_T count, then count x (INT_T user, INT_T item, INT_T rating) with raw
+// ids. codedUsr / codedItm map raw -> coded ids, -1 for unknown ids, those
+// entries are dropped and counted. The result is grouped by user.
+template<typename USR_MAP, typename ITM_MAP>
+long long loadTestSetRatings(const char *path, USR_MAP codedUsr, ITM_MAP codedItm,
+  vector<TEST_RATING_T> &testSet)
+{
+  FILE *fp = fopen(path, "rb");
+  if(!fp)
+    throw("loadTestSetRatings !fp");
+
+  INT_T numEntries = 0;
+  if(fread(&numEntries, sizeof(INT_T), 1, fp) != 1 || numEntries < 0) {
+    fclose(fp);
+    throw("loadTestSetRatings header");
+  }
+
+  vector<INT_T> raw(3 * (size_t) numEntries);
+  size_t got = numEntries ? fread(&raw[0], 3 * sizeof(INT_T), numEntries, fp) : 0;
+  fclose(fp);
+  if(got != numEntries)
+    throw("loadTestSetRatings short file");
+
+  long long unknown = 0;
+  testSet.clear();
+  testSet.reserve(numEntries);
+  for(long long x = 0; x < numEntries; x++) {
+    INT_T u = codedUsr(raw[3*x]);
+    INT_T i = codedItm(raw[3*x + 1]);
+    if(u < 0 || i < 0) {
+      unknown++;
+      continue;
+    }
+    testSet.push_back(TEST_RATING_T(u, i, raw[3*x + 2]));
+  }
+  sort(testSet.begin(), testSet.end());
+  return unknown;
+}
+
+// RMSE / MAE of predict(usr, itm) over testSet, NAN predictions are
+// skipped. Keep testSet grouped by user (sorted) so a batch touches few
+// users' rows. Batches are summed locally and added to the thread's own
+// slot, the slots are added up at the end, no locks or atomics per rating.
+template<typename PREDICT_FN>
+EVAL_RESULT_T evaluateRatings(const vector<TEST_RATING_T> &testSet,
+  PREDICT_FN predict, INT_T threadCount, long long batchSize = 4096)
+{
+  typedef struct PARTIAL_T {
+    double sse, sae;
+    long long count, skipped;
+    char pad[32]; // keep slots on separate cache lines
+  } PARTIAL_T;
+
+  threadCount = resolveThreadCount(threadCount);
+  vector<PARTIAL_T> partial(threadCount);
+  for(INT_T t = 0; t < threadCount; t++) {
+    partial[t].sse = partial[t].sae = 0;
+    partial[t].count = partial[t].skipped = 0;
+  }
+
+  parallelForBatches(testSet.size(), batchSize, threadCount,
+    [&](long long first, long long last, INT_T t) {
+      double sse = 0, sae = 0;
+      long long count = 0, skipped = 0;
+      for(long long x = first; x < last; x++) {
+        const TEST_RATING_T &tr = testSet[x];
+        FLT_T p = predict(tr.usr, tr.itm);
+        if(isnan(p)) {
+          skipped++;
+          continue;
+        }
+        double e = tr.rating - p;
+        sse += e * e;
+        sae += fabs(e);
+        count++;
+      }
+      partial[t].sse += sse;
+      partial[t].sae += sae;
+      partial[t].count += count;
+      partial[t].skipped += skipped;
+    });
+
+  EVAL_RESULT_T res;
+  double sse = 0, sae = 0;
+  for(INT_T t = 0; t < threadCount; t++) {
+    sse += partial[t].sse;
+    sae += partial[t].sae;
+    res.count += partial[t].count;
+    res.skipped += partial[t].skipped;
+  }
+  if(res.count) {
+    res.rmse = sqrt(sse / res.count);
+    res.mae = sae / res.count;
+  }
+  return res;
+}
+
+#endif // RATINGEVALUATOR_HPP
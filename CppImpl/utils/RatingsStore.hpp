@@ -6,6 +6,7 @@
 #include <mutex>
 #include <algorithm>
 #include "Utils.hpp"
+#include "IdRelabeler.hpp"
 
 typedef struct Rating_T {
   INT_T uid;
@@ -28,6 +29,7 @@ class RatingsStore {
   INT_T numThreads;
 
   vector <INT_T> uidList, iidList;
+  vector <long long> usrRatingCount, itmRatingCount; // by coded id, pass1 only
   vector<FLT_T> itemAvgRating;
   vector<RatingVector *> itemVectorCache;
   vector<RatingVector> rtVec;
@@ -318,10 +320,14 @@ class RatingsStore {
       }
       if(updateCount(uMap, usr, usrCount, uidList)){
         usrCount++;
+        usrRatingCount.push_back(0);
       }
       if(updateCount(iMap, itm, itmCount, iidList)){
         itmCount++;
+        itmRatingCount.push_back(0);
       }
+      usrRatingCount[uMap[usr]]++;
+      itmRatingCount[iMap[itm]]++;
       count++;
     }
 
@@ -335,6 +341,20 @@ class RatingsStore {
   END_TIME_STAMP;
   }
 
+  // replaces first seen order with most active users and most
+  // popular items first
+  void relabelIds()
+  {
+  START_TIME_STAMP("relabelIds");
+    relabelByCount(uidList, usrRatingCount);
+    relabelByCount(iidList, itmRatingCount);
+    for(INT_T k=0; k<uidList.size(); k++)
+      uMap[uidList[k]] = k;
+    for(INT_T k=0; k<iidList.size(); k++)
+      iMap[iidList[k]] = k;
+  END_TIME_STAMP;
+  }
+
   void writeIndexFile(vector<INT_T> &vs, string fileName) {
     cout << " writeIndexFile " << endl;
     FILE * fp = fopen(fileName.c_str(), "wb");
@@ -444,13 +464,16 @@ class RatingsStore {
   }
 
   public:
-  RatingsStore(string _ratingsCSV, string _indexFileDir, INT_T _numThreads) :
+  RatingsStore(string _ratingsCSV, string _indexFileDir, INT_T _numThreads,
+    bool relabel = false) :
     ratingsCSV(_ratingsCSV), indexFileDir(_indexFileDir),
     numThreads(_numThreads)
   {
     createOutpuFileDirs();
 
     readCSV_pass1();
+    if(relabel)
+      relabelIds();
     readCSV_pass2();
     writeIndexFiles();
     writeItemVectors(numThreads);
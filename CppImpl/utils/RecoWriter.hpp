@@ -0,0 +1,234 @@
+#ifndef RECOWRITER_HPP
+#define RECOWRITER_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "Utils.hpp"
+
+using namespace std;
+
+// Output of the all-users recommendation runs. Every worker thread owns
+// one shard and appends to an in-memory buffer, full buffers are handed to
+// a single background thread that does the file I/O, so scoring never
+// waits on the filesystem unless maxQueuedBytes are already pending.
+//
+// Formats, dir is used as a prefix:
+//  files  one <realUsr>_<codedUsr>.reco.txt per user, an item id per line
+//         (what the predictors always wrote)
+//  tsv    recos.<shard>.tsv, "realUsr<TAB>item,item,...\n" per user
+//  bin    recos.<shard>.bin, per user INT_T realUsr, INT_T n, n INT_T items
+//         recos.<shard>.idx, per user INT_T realUsr and the long long offset
+//         of the user's record in the .bin, packed in 12 bytes
+class RecoWriter {
+  typedef struct WRITE_JOB_T {
+    INT_T stream; // index in streams, -1 for a file of its own
+    STRING_T path;
+    STRING_T data;
+  } WRITE_JOB_T;
+
+  typedef struct SHARD_T {
+    STRING_T data;
+    STRING_T index;
+    long long offset; // bytes of data written or queued so far
+    SHARD_T() : offset(0) { }
+  } SHARD_T;
+
+  STRING_T dir;
+  STRING_T format;
+  size_t flushBytes;
+  size_t maxQueuedBytes;
+
+  vector<SHARD_T> shards;
+  vector<FILE *> streams; // bin: data 2*shard, index 2*shard+1
+  deque<WRITE_JOB_T> jobs;
+  size_t queuedBytes;
+  bool closing;
+  std::atomic<long long> usersWritten;
+  mutex mtx;
+  condition_variable jobReady, jobDone;
+  thread writerThread;
+
+  FILE * openStream(const STRING_T &name)
+  {
+    STRING_T path(dir + name);
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp) {
+      cout << " RecoWriter Unable to write to file " << path << endl;
+      throw("RecoWriter::openStream if(!fp)");
+    }
+    return fp;
+  }
+
+  void queueJob(INT_T stream, STRING_T &path, STRING_T &data)
+  {
+    unique_lock<mutex> lock(mtx);
+    jobDone.wait(lock, [this] { return queuedBytes < maxQueuedBytes; });
+    jobs.push_back(WRITE_JOB_T());
+    WRITE_JOB_T &job = jobs.back();
+    job.stream = stream;
+    job.path.swap(path);
+    job.data.swap(data);
+    queuedBytes += job.data.size();
+    jobReady.notify_one();
+  }
+
+  void writeJob(WRITE_JOB_T &job)
+  {
+    if(job.stream >= 0) {
+      if(job.data.size() && fwrite(job.data.data(), job.data.size(), 1, streams[job.stream]) != 1)
+        cout << " RecoWriter write failed for shard stream " << job.stream << endl;
+      return;
+    }
+    FILE *fp = fopen(job.path.c_str(), "wb");
+    if(!fp) {
+      cout << " saveRecommendationsToFileSystem Unable to write to file "
+        << job.path << endl;
+      return;
+    }
+    if(job.data.size() && fwrite(job.data.data(), job.data.size(), 1, fp) != 1)
+      cout << " saveRecommendationsToFileSystem write failed for " << job.path << endl;
+    fclose(fp);
+  }
+
+  void writerLoop()
+  {
+    while(true) {
+      WRITE_JOB_T job;
+      {
+        unique_lock<mutex> lock(mtx);
+        jobReady.wait(lock, [this] { return !jobs.empty() || closing; });
+        if(jobs.empty())
+          return;
+        job.stream = jobs.front().stream;
+        job.path.swap(jobs.front().path);
+        job.data.swap(jobs.front().data);
+        jobs.pop_front();
+      }
+      writeJob(job);
+      {
+        lock_guard<mutex> lock(mtx);
+        queuedBytes -= job.data.size();
+      }
+      jobDone.notify_all();
+    }
+  }
+
+  void flushShard(INT_T shard)
+  {
+    SHARD_T &s = shards[shard];
+    STRING_T noPath;
+    if(format == "bin") {
+      queueJob(2 * shard, noPath, s.data);
+      queueJob(2 * shard + 1, noPath, s.index);
+    } else {
+      queueJob(shard, noPath, s.data);
+    }
+    s.data.clear();
+    s.index.clear();
+  }
+
+  template<typename T>
+  void append(STRING_T &buf, const T &v)
+  {
+    buf.append((const char *) &v, sizeof(v));
+  }
+
+public:
+  RecoWriter(STRING_T _dir, STRING_T _format, INT_T numShards,
+    size_t _flushBytes = 1 << 20, size_t _maxQueuedBytes = 256 << 20) :
+    dir(_dir), format(_format), flushBytes(_flushBytes),
+    maxQueuedBytes(_maxQueuedBytes), shards(numShards), queuedBytes(0),
+    closing(false), usersWritten(0)
+  {
+    if(format != "files" && format != "tsv" && format != "bin")
+      throw("RecoWriter unknown format, use files, tsv or bin");
+
+    for(INT_T s = 0; s < numShards; s++) {
+      char name[64];
+      if(format == "tsv") {
+        snprintf(name, sizeof(name), "recos.%d.tsv", s);
+        streams.push_back(openStream(name));
+      } else if(format == "bin") {
+        snprintf(name, sizeof(name), "recos.%d.bin", s);
+        streams.push_back(openStream(name));
+        snprintf(name, sizeof(name), "recos.%d.idx", s);
+        streams.push_back(openStream(name));
+      }
+    }
+    writerThread = thread(&RecoWriter::writerLoop, this);
+  }
+
+  ~RecoWriter()
+  {
+    close();
+  }
+
+  // Only the worker owning shard may call this. recoList is best first and
+  // holds real item ids in itemId.
+  template<typename RECO_T>
+  void write(INT_T shard, INT_T realUsr, INT_T codedUsr, const vector<RECO_T> &recoList)
+  {
+    SHARD_T &s = shards[shard];
+    char num[32];
+
+    if(format == "bin") {
+      append(s.index, realUsr);
+      append(s.index, s.offset);
+      size_t before = s.data.size();
+      INT_T n = recoList.size();
+      append(s.data, realUsr);
+      append(s.data, n);
+      for(INT_T i = 0; i < n; i++)
+        append(s.data, recoList[i].itemId);
+      s.offset += s.data.size() - before;
+    } else if(format == "tsv") {
+      s.data.append(num, snprintf(num, sizeof(num), "%d\t", realUsr));
+      for(INT_T i = 0; i < recoList.size(); i++)
+        s.data.append(num, snprintf(num, sizeof(num), i ? ",%d" : "%d", recoList[i].itemId));
+      s.data.push_back('\n');
+    } else {
+      STRING_T data;
+      for(INT_T i = 0; i < recoList.size(); i++)
+        data.append(num, snprintf(num, sizeof(num), "%d\n", recoList[i].itemId));
+      STRING_T path(dir);
+      path.append(num, snprintf(num, sizeof(num), "%d_%d.reco.txt", realUsr, codedUsr));
+      queueJob(-1, path, data);
+    }
+
+    if(s.data.size() >= flushBytes)
+      flushShard(shard);
+    usersWritten++;
+  }
+
+  // flushes the shards and waits for the background thread,
+  // call once every worker is done
+  void close()
+  {
+    if(!writerThread.joinable())
+      return;
+    if(format != "files") {
+      for(INT_T s = 0; s < shards.size(); s++)
+        flushShard(s);
+    }
+    {
+      lock_guard<mutex> lock(mtx);
+      closing = true;
+    }
+    jobReady.notify_all();
+    writerThread.join();
+
+    for(INT_T i = 0; i < streams.size(); i++)
+      fclose(streams[i]);
+    streams.clear();
+    cout << " RecoWriter wrote recommendations of " << usersWritten
+      << " users to " << dir << " format " << format << endl;
+  }
+};
+
+#endif // RECOWRITER_HPP
@@ -0,0 +1,78 @@
+#ifndef TOPN_HPP
+#define TOPN_HPP
+
+#include <vector>
+#include <algorithm>
+#include "Utils.hpp"
+
+using namespace std;
+
+// Exact best N (id, score) pairs out of a stream of candidates, highest
+// score first, equal scores go to the lower id. A fixed capacity heap
+// keeps the worst of the current best N on top so most candidates are
+// rejected with one compare, O(candidates * log N) overall.
+// Meant to be kept per thread and reset per user, the heap and the
+// output vector keep their capacity so nothing is allocated per user.
+class TopNSelector {
+  typedef struct TOPN_ENTRY_T {
+    INT_T id;
+    FLT_T score;
+  } TOPN_ENTRY_T;
+
+  // true when a ranks before b, makes the heap top the worst entry
+  static bool better(const TOPN_ENTRY_T &a, const TOPN_ENTRY_T &b)
+  {
+    return a.score > b.score || (a.score == b.score && a.id < b.id);
+  }
+
+  vector<TOPN_ENTRY_T> heap;
+  INT_T N;
+
+public:
+  TopNSelector(INT_T n = 0) : N(n)
+  {
+    heap.reserve(n);
+  }
+
+  void reset(INT_T n)
+  {
+    N = n;
+    heap.clear();
+    heap.reserve(n);
+  }
+
+  void reset() { heap.clear(); }
+
+  INT_T size() const { return heap.size(); }
+  bool full() const { return heap.size() >= N; }
+
+  void offer(INT_T id, FLT_T score)
+  {
+    if(N <= 0)
+      return;
+    TOPN_ENTRY_T e;
+    e.id = id;
+    e.score = score;
+    if(heap.size() < N) {
+      heap.push_back(e);
+      push_heap(heap.begin(), heap.end(), better);
+    } else if(better(e, heap.front())) {
+      pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = e;
+      push_heap(heap.begin(), heap.end(), better);
+    }
+  }
+
+  // T is built as T(id, score), best first. Empties the selector.
+  template<typename T>
+  void getSorted(vector<T> &out)
+  {
+    sort_heap(heap.begin(), heap.end(), better);
+    out.clear();
+    for(INT_T x = 0; x < heap.size(); x++)
+      out.push_back(T(heap[x].id, heap[x].score));
+    heap.clear();
+  }
+};
+
+#endif // TOPN_HPP
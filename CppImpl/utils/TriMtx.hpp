@@ -0,0 +1,212 @@
+#ifndef TRIMTX_HPP
+#define TRIMTX_HPP
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include "Utils.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+
+// Symmetric n x n matrix keeping only the cells above the diagonal,
+// packed row by row, half the memory and file size of a dense Mtx.
+// get(r,c) == get(c,r) and set() writes the single shared cell.
+// The diagonal is not stored, get(r,r) returns FLT_T_MIN().
+//
+// File: long long n, long long TRI_MTX_MARK, n*(n-1)/2 FLT_T values.
+// A dense Mtx file (rows, cols header) can be read as well and is packed
+// while loading.
+class TriMtx {
+  FLT_T * dat;
+  size_t mtxDataSz;
+  MappedFile *mapped; // dat points into it, read only, when not 0
+
+  static const long long TRI_MTX_MARK = -3;
+
+  FLT_T * allocateMem() {
+    mtxDataSz = sizeof(FLT_T) * numCells();
+    return (FLT_T *) malloc (mtxDataSz ? mtxDataSz : 1);
+  }
+
+  // start of packed row r, the cells (r, r+1) .. (r, n-1)
+  long long rowOffset(long long r) const {
+    return r * (2 * rows - r - 1) / 2;
+  }
+
+  long long index(long long r, long long c) const {
+    if(r > c)
+      swap(r, c);
+    return rowOffset(r) + (c - r - 1);
+  }
+
+  void readDense(FILE *fp)
+  {
+    vector<FLT_T> row(cols);
+    for(long long r=0; r<rows; r++) {
+      if(fread(row.data(), sizeof(FLT_T), cols, fp) != cols)
+        throw("TriMtx::readDense fread");
+      if(r+1 < cols)
+        memcpy(dat + rowOffset(r), row.data() + r + 1, sizeof(FLT_T) * (cols - r - 1));
+    }
+  }
+
+public:
+  long long rows, cols;
+
+  TriMtx(INT_T n, FLT_T initVal = 0) : dat(0), mapped(0), rows(n), cols(n) {
+    dat = allocateMem();
+    for(long long x=0; x<numCells(); x++)
+      dat[x] = initVal;
+  }
+
+  TriMtx(const char* filePath) : dat(0), mapped(0), rows(0), cols(0) {
+    readMtxFromFileSystem(filePath);
+  }
+
+  // mmap modes give a read only matrix, a dense file still has to be
+  // packed and is read instead
+  TriMtx(const char* filePath, MTX_LOAD_T mode) : dat(0), mapped(0), rows(0), cols(0) {
+    if(mode == MTX_LOAD_READ || !mapMtxFromFileSystem(filePath, mode))
+      readMtxFromFileSystem(filePath);
+  }
+
+  ~TriMtx() {
+    if(mapped) {
+      delete mapped;
+      mapped = 0;
+      dat = 0;
+    }
+    if(dat) {
+      free(dat);
+      dat = 0;
+    }
+  }
+
+  long long numCells() const { return rows * (rows - 1) / 2; }
+
+  FLT_T get(INT_T r, INT_T c) const {
+    if(r == c)
+      return FLT_T_MIN();
+    return dat[index(r, c)];
+  }
+
+  void set(INT_T r, INT_T c, FLT_T v) {
+    if(r != c)
+      dat[index(r, c)] = v;
+  }
+
+  // full row r of the symmetric matrix into out[0..n), the part left of
+  // the diagonal is gathered from the rows above, the rest is one copy
+  void copyRow(INT_T r, FLT_T *out) const {
+    long long idx = r - 1; // cell (0, r)
+    for(long long c=0; c<r; c++) {
+      out[c] = dat[idx];
+      idx += rows - c - 2;
+    }
+    out[r] = FLT_T_MIN();
+    if(r+1 < rows)
+      memcpy(out + r + 1, dat + rowOffset(r), sizeof(FLT_T) * (rows - r - 1));
+  }
+
+  void writeMtxToFileSystem(const char* filePath)
+  {
+    FILE * fp = fopen(filePath, "wb");
+    if(!fp)
+      throw("TriMtx::writeMtxToFileSystem if(!fp)");
+
+    long long mark = TRI_MTX_MARK;
+    if(fwrite(&rows, sizeof(rows), 1, fp) + fwrite(&mark, sizeof(mark), 1, fp) != 2)
+      throw("TriMtx::writeMtxToFileSystem header");
+    if(mtxDataSz && fwrite(dat, mtxDataSz, 1, fp) != 1)
+      throw("TriMtx::writeMtxToFileSystem data");
+    fclose(fp);
+  }
+
+  void readMtxFromFileSystem(const char* filePath)
+  {
+    FILE * fp = fopen(filePath, "rb");
+    if(!fp)
+      throw("TriMtx::readMtxFromFileSystem if(!fp)");
+
+    long long r = 0, c = 0;
+    if(fread(&r, sizeof(r), 1, fp) + fread(&c, sizeof(c), 1, fp) != 2 || r <= 0)
+      throw("TriMtx::readMtxFromFileSystem header");
+    if(c != TRI_MTX_MARK && c != r)
+      throw("TriMtx::readMtxFromFileSystem not a square matrix");
+
+    rows = cols = r;
+    dat = allocateMem();
+    if(!dat)
+      throw("TriMtx::readMtxFromFileSystem if(!dat)");
+
+    if(c == TRI_MTX_MARK) {
+      if(mtxDataSz && fread(dat, mtxDataSz, 1, fp) != 1)
+        throw("TriMtx::readMtxFromFileSystem data");
+    } else {
+      cout << " TriMtx packing dense matrix file " << filePath << "\n";
+      readDense(fp);
+    }
+    fclose(fp);
+  }
+
+  // false for a dense file, those are left to readMtxFromFileSystem
+  bool mapMtxFromFileSystem(const char* filePath, MTX_LOAD_T mode)
+  {
+    MappedFile *mf = new MappedFile(filePath, mode);
+    const long long *hdr = (const long long *) mf->data();
+    if(mf->size() < 2 * sizeof(long long) || hdr[1] != TRI_MTX_MARK || hdr[0] <= 0) {
+      delete mf;
+      return false;
+    }
+    mapped = mf;
+    rows = cols = hdr[0];
+    mtxDataSz = sizeof(FLT_T) * numCells();
+    if(mapped->size() < 2 * sizeof(long long) + mtxDataSz)
+      throw("TriMtx::mapMtxFromFileSystem file shorter than n*(n-1)/2");
+    dat = (FLT_T *) (mapped->data() + 2 * sizeof(long long));
+    return true;
+  }
+
+  bool isMapped() const { return mapped != 0; }
+
+  bool compare(const TriMtx &m2) const
+  {
+    if(rows != m2.rows) {
+      cout << " TriMtx::compare if(rows != m2.rows)\n";
+      return false;
+    }
+    for(long long x=0; x<numCells(); x++) {
+      if(dat[x] != m2.dat[x] && !(isnan(dat[x]) && isnan(m2.dat[x]))) {
+        cout << " TriMtx::compare cell " << x << " " << dat[x]
+          << " != " << m2.dat[x] << "\n";
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+#endif // TRIMTX_HPP
+
+#ifdef ENABLE_MAIN
+// g++ TriMtx.hpp -x c++ -o /tmp/t1 -DENABLE_MAIN
+int main() {
+  TriMtx m(5);
+  for(INT_T r=0; r<5; r++)
+    for(INT_T c=r+1; c<5; c++)
+      m.set(c, r, r*10 + c);
+
+  m.writeMtxToFileSystem("/tmp/tri_5.dat");
+  TriMtx m2("/tmp/tri_5.dat");
+  FLT_T row[5];
+  for(INT_T r=0; r<5; r++) {
+    m2.copyRow(r, row);
+    for(INT_T c=0; c<5; c++)
+      cout << " " << (r == c ? 0 : row[c]) << (row[c] == m.get(r, c) ? "" : "!");
+    cout << "\n";
+  }
+  cout << " compare " << m.compare(m2) << "\n";
+}
+#endif
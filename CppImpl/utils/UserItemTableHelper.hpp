@@ -45,10 +45,13 @@ class UserItemTableHelper {
   INT_T * iidRMap;
   vector<RatingVector> itemRV; // itembased rating vector
   vector<DynBitSet> userBst; // user bitset
+  bool useGivenIndexes;
+  INT_T umax, imax;
 
   UserItemTableHelper(STRING_T _userItemCSV, STRING_T _outputFilesDir = STRING_T("/tmp/")):
     userItemCSV(_userItemCSV),
-    outputFilesDir(_outputFilesDir)
+    outputFilesDir(_outputFilesDir),
+    uidRMap(0), iidRMap(0), useGivenIndexes(false), umax(0), imax(0)
   {
     MAX_USERS = 5400000;
     MAX_ITEMS = 100000;
@@ -72,6 +75,18 @@ class UserItemTableHelper {
     populateRatings();
   }
 
+  // Use the coded ids of an existing model (index tables map coded id ->
+  // raw id), needed when the model's ids are not in sorted raw id order.
+  // Ratings of users or items outside the tables are ignored.
+  void prepareTable(const vector<INT_T> &userIndex, const vector<INT_T> &itemIndex)
+  {
+    user_index_table = userIndex;
+    item_index_table = itemIndex;
+    useGivenIndexes = true;
+    readInput();
+    populateRatings();
+  }
+
   void populateRatings()
   { // convert to internal form
     cout << " populateRatings item_index_table.size() "
@@ -80,7 +95,6 @@ class UserItemTableHelper {
     itemRV = vector<RatingVector>(item_index_table.size());
     userBst = vector<DynBitSet> (item_index_table.size());
 
-    INT_T umax = user_index_table[user_index_table.size() -1] + 1;
     for(INT_T i = 0; i< itemRV.size(); i++) {
       //cout << " userBst[" << i << "] for size " << umax << endl;
       userBst[i]  = DynBitSet(umax);
@@ -90,6 +104,8 @@ class UserItemTableHelper {
       INT_T u = re.user_id;
       INT_T iid = re.item_id;
       //FLT_T r = re.rating;
+      if(u >= umax || iid >= imax || uidRMap[u] < 0 || iidRMap[iid] < 0)
+        continue;
       INT_T newIid = iidRMap[iid];
       INT_T newUid = uidRMap[u];
       RatingVector &rv = itemRV[newIid];
@@ -108,19 +124,23 @@ class UserItemTableHelper {
   }
 
   void mapUserAndItemIndexes() {
-    sort(user_index_table.begin(), user_index_table.end()); // sorted user ids
-    sort(item_index_table.begin(), item_index_table.end()); // sorted item ids
+    if(!useGivenIndexes) {
+      sort(user_index_table.begin(), user_index_table.end()); // sorted user ids
+      sort(item_index_table.begin(), item_index_table.end()); // sorted item ids
+    }
 
-    INT_T umax = user_index_table[user_index_table.size() -1] + 1;
-    INT_T imax = item_index_table[item_index_table.size() -1] + 1;
+    umax = *max_element(user_index_table.begin(), user_index_table.end()) + 1;
+    imax = *max_element(item_index_table.begin(), item_index_table.end()) + 1;
 
-    uidRMap = new INT_T[umax]();
-    iidRMap = new INT_T[imax]();
+    uidRMap = new INT_T[umax];
+    iidRMap = new INT_T[imax];
 
     if(!uidRMap || !iidRMap) {
       cout << " if(!uidRMap || !iidRMap) \n";
       return;
     }
+    fill(uidRMap, uidRMap + umax, -1);
+    fill(iidRMap, iidRMap + imax, -1);
 
     INT_T i = 0;
     for(vector<INT_T>::iterator it = user_index_table.begin(),
@@ -167,13 +187,15 @@ class UserItemTableHelper {
         break;
       }
 
-      if(uid_table[userid] == 0) {
-        uid_table[userid] = 1;
-        user_index_table.push_back(userid);
-      }
-      if(iid_table[itemid] == 0) {
-        iid_table[itemid] = 1;
-        item_index_table.push_back(itemid);
+      if(!useGivenIndexes) {
+        if(uid_table[userid] == 0) {
+          uid_table[userid] = 1;
+          user_index_table.push_back(userid);
+        }
+        if(iid_table[itemid] == 0) {
+          iid_table[itemid] = 1;
+          item_index_table.push_back(itemid);
+        }
       }
 
       ratingsList.push_back(RatingEntry_T(userid, itemid, rating));
@@ -5,6 +5,9 @@
 #include <vector>
 #include <limits>
 #include <ctime>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
 #include <algorithm>
 
 using namespace std;
@@ -100,6 +103,22 @@ inline INT_T_VEC getRandomShuffledIndexes(INT_T indexRangeMaxValue, INT_T startI
   return riv;
 }
 
+// "5,10,20" -> {5, 10, 20}
+template<typename T>
+inline vector<T> parseCommaList(const STRING_T &s)
+{
+  vector<T> v;
+  std::istringstream ss(s);
+  STRING_T tok;
+  while(getline(ss, tok, ',')) {
+    std::istringstream ts(tok);
+    T x;
+    if(ts >> x)
+      v.push_back(x);
+  }
+  return v;
+}
+
 #define OPT(a, b, c, d) \
   params.a = varMap.count( b ) ? varMap[ b ].as< c > () : d
 